@@ -0,0 +1,401 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// Discovery throughput benchmark.
+//
+// This injects synthetic SSDP messages for a number of fake devices
+// directly into the discovery callback, and serves their description
+// documents from a loopback HTTP server, with optional latency and
+// failures. It then reports the message throughput, the time needed
+// for the devices to reach the directory, and the peak memory usage.
+//
+// No real network activity is needed. The directory interest is set
+// to the fake device type, so that real devices on the LAN, if any,
+// do not disturb the measures.
+//
+// Build with "make bench/discobench".
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <upnp/upnp.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/ptmutex.hxx"
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/upnpputils.hxx"
+#include "libupnpp/control/description.hxx"
+#include "libupnpp/control/discovery.hxx"
+
+using namespace std;
+using namespace UPnPP;
+using namespace UPnPClient;
+
+static const char *benchDevType = "urn:libupnpp-bench:device:Bench:1";
+static const char *benchSvcType = "urn:libupnpp-bench:service:BenchSvc%d:1";
+
+static int o_ndevs = 1000;
+static int o_rounds = 2;
+static int o_nservices = 2;
+static int o_injectors = 4;
+static int o_latencyms = 0;
+static int o_jitterms = 0;
+static int o_failpct = 0;
+static int o_srvthreads = 64;
+static int o_timeout = 60;
+static int o_port;
+
+static string descDoc(int i)
+{
+    ostringstream out;
+    out << "<?xml version=\"1.0\"?>\n" <<
+        "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n" <<
+        "<specVersion><major>1</major><minor>0</minor></specVersion>\n" <<
+        "<device>\n" <<
+        "<deviceType>" << benchDevType << "</deviceType>\n" <<
+        "<friendlyName>Bench device " << i << "</friendlyName>\n" <<
+        "<manufacturer>libupnpp</manufacturer>\n" <<
+        "<modelName>discobench</modelName>\n" <<
+        "<UDN>uuid:bench-" << i << "</UDN>\n" <<
+        "<serviceList>\n";
+    for (int s = 0; s < o_nservices; s++) {
+        char stype[200];
+        snprintf(stype, sizeof(stype), benchSvcType, s);
+        out << "<service><serviceType>" << stype << "</serviceType>" <<
+            "<serviceId>urn:libupnpp-bench:serviceId:BenchSvc" << s <<
+            "</serviceId>" <<
+            "<SCPDURL>/scpd/" << s << ".xml</SCPDURL>" <<
+            "<controlURL>/ctl/" << i << "/" << s << "</controlURL>" <<
+            "<eventSubURL>/evt/" << i << "/" << s << "</eventSubURL>" <<
+            "</service>\n";
+    }
+    out << "</serviceList>\n</device>\n</root>\n";
+    return out.str();
+}
+
+// Loopback HTTP server. A fixed set of threads block in accept() on
+// the same socket, and handle one request per connection.
+static int o_listenfd = -1;
+
+static bool sendAll(int fd, const string& data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.c_str() + done, data.size() - done, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static void serveOne(int fd, unsigned int *seed)
+{
+    string req;
+    char buf[2048];
+    while (req.find("\r\n\r\n") == string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return;
+        req.append(buf, n);
+    }
+    int delay = o_latencyms;
+    if (o_jitterms > 0)
+        delay += rand_r(seed) % (o_jitterms + 1);
+    if (delay > 0)
+        usleep(delay * 1000);
+
+    int devnum;
+    if (sscanf(req.c_str(), "GET /dev/%d.xml", &devnum) != 1) {
+        sendAll(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                "Connection: close\r\n\r\n");
+        return;
+    }
+    if (o_failpct > 0 && int(rand_r(seed) % 100) < o_failpct) {
+        sendAll(fd, "HTTP/1.1 500 Internal Server Error\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        return;
+    }
+    string doc = descDoc(devnum);
+    ostringstream hdr;
+    hdr << "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\n" <<
+        "Content-Length: " << doc.size() << "\r\n" <<
+        "Connection: close\r\n\r\n";
+    sendAll(fd, hdr.str() + doc);
+}
+
+static void *serverWorker(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    for (;;) {
+        int fd = accept(o_listenfd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return 0;
+        }
+        serveOne(fd, &seed);
+        close(fd);
+    }
+}
+
+static bool startServer()
+{
+    o_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (o_listenfd < 0) {
+        perror("socket");
+        return false;
+    }
+    int one = 1;
+    setsockopt(o_listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(o_listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(o_listenfd, 1024) < 0 ||
+        getsockname(o_listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("bind/listen");
+        return false;
+    }
+    o_port = ntohs(addr.sin_port);
+    for (int i = 0; i < o_srvthreads; i++) {
+        pthread_t thr;
+        if (pthread_create(&thr, 0, serverWorker, (void *)(long)(i + 1))) {
+            perror("pthread_create");
+            return false;
+        }
+        pthread_detach(thr);
+    }
+    return true;
+}
+
+// Message injection. Each injector thread plays the role of a libupnp
+// callback thread, and sends the full set of announcement messages
+// (root device, uuid, device type, services) for its share of the
+// devices, for each round.
+static LibUPnP *o_lib;
+
+static void inject1(int i, const char *devtype, const char *stype)
+{
+    struct Upnp_Discovery disco;
+    memset(&disco, 0, sizeof(disco));
+    disco.Expires = 1800;
+    snprintf(disco.DeviceId, sizeof(disco.DeviceId), "uuid:bench-%d", i);
+    snprintf(disco.Location, sizeof(disco.Location),
+             "http://127.0.0.1:%d/dev/%d.xml", o_port, i);
+    snprintf(disco.DeviceType, sizeof(disco.DeviceType), "%s", devtype);
+    snprintf(disco.ServiceType, sizeof(disco.ServiceType), "%s", stype);
+    o_lib->dispatchEvent(UPNP_DISCOVERY_ADVERTISEMENT_ALIVE, &disco);
+}
+
+static void *injector(void *arg)
+{
+    long tid = (long)arg;
+    for (int r = 0; r < o_rounds; r++) {
+        for (int i = tid; i < o_ndevs; i += o_injectors) {
+            inject1(i, "", "");
+            inject1(i, "", "");
+            inject1(i, benchDevType, "");
+            for (int s = 0; s < o_nservices; s++) {
+                char stype[200];
+                snprintf(stype, sizeof(stype), benchSvcType, s);
+                inject1(i, "", stype);
+            }
+        }
+    }
+    return 0;
+}
+
+// Arrival times of the devices in the directory
+static vector<long long> o_arrivals;
+static PTMutexInit o_arrivals_mutex;
+
+static bool onDevice(const UPnPDeviceDesc&, const UPnPServiceDesc&)
+{
+    long long now = usecsnow();
+    PTMutexLocker lock(o_arrivals_mutex);
+    o_arrivals.push_back(now);
+    return true;
+}
+
+static size_t arrivedCount()
+{
+    PTMutexLocker lock(o_arrivals_mutex);
+    return o_arrivals.size();
+}
+
+static char *thisprog;
+static char usage [] =
+" -n <ndevs>     number of fake devices (1000)\n"
+" -r <rounds>    announcement rounds per device (2)\n"
+" -s <nservices> services per device (2)\n"
+" -t <threads>   message injection threads (4)\n"
+" -l <ms>        description server latency (0)\n"
+" -j <ms>        random additional latency (0)\n"
+" -f <percent>   description server failure rate (0)\n"
+" -S <threads>   description server threads (64)\n"
+" -w <threads>   discovery worker threads (4)\n"
+" -p <n>         max parallel description downloads (20)\n"
+" -c <secs>      coalescing window (5)\n"
+" -T <secs>      give up waiting after this (60)\n"
+" -v             print the discovery statistics\n"
+;
+static void Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+static double msecs(long long usecs)
+{
+    return usecs / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    thisprog = argv[0];
+    int workers = 4, parallel = 20, coalesce = 5;
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:s:t:l:j:f:S:w:p:c:T:v")) != -1) {
+        switch (c) {
+        case 'n': o_ndevs = atoi(optarg); break;
+        case 'r': o_rounds = atoi(optarg); break;
+        case 's': o_nservices = atoi(optarg); break;
+        case 't': o_injectors = atoi(optarg); break;
+        case 'l': o_latencyms = atoi(optarg); break;
+        case 'j': o_jitterms = atoi(optarg); break;
+        case 'f': o_failpct = atoi(optarg); break;
+        case 'S': o_srvthreads = atoi(optarg); break;
+        case 'w': workers = atoi(optarg); break;
+        case 'p': parallel = atoi(optarg); break;
+        case 'c': coalesce = atoi(optarg); break;
+        case 'T': o_timeout = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default: Usage();
+        }
+    }
+    if (optind != argc || o_ndevs <= 0 || o_rounds <= 0 ||
+        o_injectors <= 0 || o_srvthreads <= 0)
+        Usage();
+
+    signal(SIGPIPE, SIG_IGN);
+    Logger::getTheLog("")->setLogLevel(Logger::LLFAT);
+
+    if (!startServer())
+        return 1;
+
+    o_lib = LibUPnP::getLibUPnP();
+    if (!o_lib) {
+        cerr << "Can't initialize libupnp" << endl;
+        return 1;
+    }
+    UPnPDeviceDirectory::setInterest(vector<string>(1, benchDevType));
+    UPnPDeviceDirectory::setDiscoveryWorkers(workers);
+    UPnPDeviceDirectory::setDescFetchParams(parallel, 5);
+    UPnPDeviceDirectory::setCoalesceWindow(coalesce);
+    UPnPDeviceDirectory::addCallback(onDevice);
+    UPnPDeviceDirectory *dir = UPnPDeviceDirectory::getTheDir(1);
+    if (!dir || !dir->ok()) {
+        cerr << "Discovery init failed" << endl;
+        return 1;
+    }
+    UPnPDeviceDirectory::resetStats();
+
+    long long start = usecsnow();
+    vector<pthread_t> thrs(o_injectors);
+    for (int i = 0; i < o_injectors; i++) {
+        pthread_create(&thrs[i], 0, injector, (void *)(long)i);
+    }
+    for (int i = 0; i < o_injectors; i++) {
+        pthread_join(thrs[i], 0);
+    }
+    long long injected = usecsnow();
+
+    // Wait for all the devices, or until nothing happens for a while
+    // (failed downloads are not retried before the next announcement).
+    size_t last = 0;
+    long long lastchange = usecsnow();
+    for (;;) {
+        size_t cnt = arrivedCount();
+        long long now = usecsnow();
+        if (cnt >= size_t(o_ndevs) || now - start > o_timeout * 1000000LL)
+            break;
+        if (cnt != last) {
+            last = cnt;
+            lastchange = now;
+        } else if (now - lastchange > 2000000 &&
+                   UPnPDeviceDirectory::getStats().queueDepth == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    DiscoveryStats stats = UPnPDeviceDirectory::getStats();
+    vector<long long> arrivals;
+    {
+        PTMutexLocker lock(o_arrivals_mutex);
+        arrivals = o_arrivals;
+    }
+    sort(arrivals.begin(), arrivals.end());
+    long long nmsgs = (long long)o_ndevs * o_rounds * (3 + o_nservices);
+
+    cout << "devices " << o_ndevs << " rounds " << o_rounds <<
+        " messages " << nmsgs << endl;
+    cout << "injection: " << msecs(injected - start) << " mS, " <<
+        (injected > start ? nmsgs * 1000000 / (injected - start) : 0) <<
+        " messages/S" << endl;
+    cout << "in directory: " << arrivals.size() << "/" << o_ndevs << endl;
+    if (!arrivals.empty()) {
+        long long end = arrivals.back() - start;
+        cout << "time to directory (mS): first " <<
+            msecs(arrivals.front() - start) <<
+            " 50% " << msecs(arrivals[arrivals.size() / 2] - start) <<
+            " 90% " << msecs(arrivals[arrivals.size() * 9 / 10] - start) <<
+            " all " << msecs(end) << endl;
+        cout << "end to end: " <<
+            (end > 0 ? nmsgs * 1000000 / end : 0) << " messages/S" << endl;
+    }
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        cout << "peak RSS: " << ru.ru_maxrss << " KB" << endl;
+    if (verbose)
+        cout << stats.dump();
+
+    UPnPDeviceDirectory::terminate();
+    return 0;
+}
@@ -0,0 +1,623 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// SOAP request encoding benchmark.
+//
+// This compares the two ways of producing the text of a SOAP call:
+// building an IXML DOM with SoapOutgoing::buildSoapBody() and
+// serializing it (as libupnp does before sending), or writing the
+// envelope directly with SoapOutgoing::buildSoapEnvelope(). The
+// calls are typical high-rate renderer actions (volume, seek,
+// position poll), plus a SetAVTransportURI with escaped metadata.
+//
+// Only the encoding is measured, the SoapOutgoing objects are built
+// beforehand. No network activity is involved.
+//
+// With -r, the program instead measures action round trips
+// (GetPositionInfo) through Service::runAction(), using either
+// libupnp or the keep-alive SOAP transport. The actions are sent to a
+// stand-in device on the loopback interface, or to a real one (-u).
+// With -A, a single thread issues all the actions through
+// Service::runActionAsync(), spread over -D stand-in devices. With
+// -B, the action is sent to all the devices at once as an
+// ActionBatch, and the batch time is measured.
+//
+// Build with "make bench/soapbench".
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <upnp/ixml.h>
+#include <upnp/upnp.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "libupnpp/soaphelp.hxx"
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/upnpputils.hxx"
+#include "libupnpp/control/description.hxx"
+#include "libupnpp/control/service.hxx"
+#include "libupnpp/control/soaptransport.hxx"
+
+using namespace std;
+using namespace UPnPP;
+using namespace UPnPClient;
+
+static const char *o_avt = "urn:schemas-upnp-org:service:AVTransport:1";
+static const char *o_rdc = "urn:schemas-upnp-org:service:RenderingControl:1";
+
+static const char *o_meta =
+    "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+    "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+    "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\">"
+    "<item id=\"0$1$12$3\" parentID=\"0$1$12\" restricted=\"1\">"
+    "<dc:title>Rock &amp; Roll</dc:title>"
+    "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+    "<res protocolInfo=\"http-get:*:audio/flac:*\" duration=\"0:04:12\">"
+    "http://192.168.1.10:9000/music/track.flac</res></item></DIDL-Lite>";
+
+static void buildCalls(vector<SoapOutgoing*>& calls)
+{
+    SoapOutgoing *call;
+
+    call = new SoapOutgoing(o_rdc, "SetVolume");
+    (*call)("InstanceID", "0")("Channel", "Master")("DesiredVolume", "42");
+    calls.push_back(call);
+
+    call = new SoapOutgoing(o_rdc, "GetVolume");
+    (*call)("InstanceID", "0")("Channel", "Master");
+    calls.push_back(call);
+
+    call = new SoapOutgoing(o_avt, "Seek");
+    (*call)("InstanceID", "0")("Unit", "REL_TIME")("Target", "0:01:23");
+    calls.push_back(call);
+
+    call = new SoapOutgoing(o_avt, "GetPositionInfo");
+    (*call)("InstanceID", "0");
+    calls.push_back(call);
+
+    call = new SoapOutgoing(o_avt, "SetAVTransportURI");
+    (*call)("InstanceID", "0")
+        ("CurrentURI", "http://192.168.1.10:9000/music/track.flac?a=1&b=2")
+        ("CurrentURIMetaData", o_meta);
+    calls.push_back(call);
+}
+
+// What libupnp does with the DOM before sending it.
+static const char *o_envstart =
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+    "<s:Body>";
+static const char *o_envend = "</s:Body>\r\n</s:Envelope>\r\n";
+
+static size_t domEncode(const SoapOutgoing& call, string& out)
+{
+    IXML_Document *doc = call.buildSoapBody(false);
+    if (doc == 0)
+        return 0;
+    DOMString body = ixmlPrintNode((IXML_Node*)doc);
+    out = o_envstart;
+    if (body)
+        out += body;
+    out += o_envend;
+    ixmlFreeDOMString(body);
+    ixmlDocument_free(doc);
+    return out.size();
+}
+
+static size_t directEncode(const SoapOutgoing& call, string& out)
+{
+    call.buildSoapEnvelope(out, false);
+    return out.size();
+}
+
+// Run the encoder over all the calls, iters times. Returns the mean
+// time per call in nS.
+static double runBench(size_t (*encode)(const SoapOutgoing&, string&),
+                       const vector<SoapOutgoing*>& calls, int iters,
+                       size_t *bytes)
+{
+    string buf;
+    size_t total = 0;
+    long long start = usecsnow();
+    for (int i = 0; i < iters; i++) {
+        for (auto it = calls.begin(); it != calls.end(); it++) {
+            total += encode(**it, buf);
+        }
+    }
+    long long elapsed = usecsnow() - start;
+    *bytes = total;
+    return double(elapsed) * 1000.0 / (double(iters) * calls.size());
+}
+
+// Stand-in device for the round trip test: an HTTP/1.1 server which
+// answers all SOAP requests with a canned response, keeping the
+// connections open. With -d, some of the requests which come on an
+// already used connection are dropped (the connection is closed
+// without an answer), as happens when a device closes an idle
+// connection while a request is on its way. Each stand-in has its
+// own response latency (-l, and -S for the first one).
+static int o_droppct;
+
+class ConnArg {
+public:
+    ConnArg(int _fd, int _latencyms) : fd(_fd), latencyms(_latencyms) {}
+    int fd;
+    int latencyms;
+};
+
+static bool sendAll(int fd, const string& data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.c_str() + done, data.size() - done, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Extract service type and action from the SOAPACTION header:
+// SOAPACTION: "urn:schemas-upnp-org:service:AVTransport:1#Play"
+static bool soapAction(const string& headers, string& stype, string& action)
+{
+    const char *cp = strcasestr(headers.c_str(), "\r\nSOAPACTION:");
+    if (cp == 0)
+        return false;
+    string value(cp + 13, headers.c_str() + headers.size());
+    string::size_type q1 = value.find('"');
+    string::size_type hash = value.find('#');
+    string::size_type q2 = value.find('"', hash);
+    if (q1 == string::npos || hash == string::npos || q2 == string::npos)
+        return false;
+    stype = value.substr(q1 + 1, hash - q1 - 1);
+    action = value.substr(hash + 1, q2 - hash - 1);
+    return true;
+}
+
+static void *connWorker(void *arg)
+{
+    ConnArg *carg = (ConnArg *)arg;
+    int fd = carg->fd;
+    int latencyms = carg->latencyms;
+    delete carg;
+    unsigned int seed = fd;
+    string buf;
+    char rbuf[4096];
+    for (int nreq = 0;; nreq++) {
+        string::size_type hend;
+        while ((hend = buf.find("\r\n\r\n")) == string::npos) {
+            ssize_t n = recv(fd, rbuf, sizeof(rbuf), 0);
+            if (n <= 0)
+                goto out;
+            buf.append(rbuf, n);
+        }
+        string headers = buf.substr(0, hend);
+        size_t clen = 0;
+        const char *cl = strcasestr(headers.c_str(), "\r\nContent-Length:");
+        if (cl)
+            clen = atoi(cl + 17);
+        while (buf.size() < hend + 4 + clen) {
+            ssize_t n = recv(fd, rbuf, sizeof(rbuf), 0);
+            if (n <= 0)
+                goto out;
+            buf.append(rbuf, n);
+        }
+        buf.erase(0, hend + 4 + clen);
+
+        if (nreq > 0 && o_droppct > 0 && int(rand_r(&seed) % 100) < o_droppct)
+            goto out;
+        if (latencyms > 0)
+            usleep(latencyms * 1000);
+
+        string stype, action;
+        if (!soapAction(headers, stype, action)) {
+            sendAll(fd, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n"
+                    "Connection: close\r\n\r\n");
+            goto out;
+        }
+        SoapOutgoing resp(stype, action);
+        resp("Track", "1")("TrackDuration", "0:04:12")
+            ("TrackMetaData", o_meta)("TrackURI", "http://192.168.1.10/t.flac")
+            ("RelTime", "0:01:23")("AbsTime", "NOT_IMPLEMENTED")
+            ("RelCount", "2147483647")("AbsCount", "2147483647");
+        string body;
+        resp.buildSoapEnvelope(body, true);
+        ostringstream hdr;
+        hdr << "HTTP/1.1 200 OK\r\n" << 
+            "Content-Type: text/xml; charset=\"utf-8\"\r\n" <<
+            "Content-Length: " << body.size() << "\r\n\r\n";
+        if (!sendAll(fd, hdr.str() + body))
+            goto out;
+    }
+out:
+    close(fd);
+    return 0;
+}
+
+static void *acceptWorker(void *arg)
+{
+    ConnArg *larg = (ConnArg *)arg;
+    int listenfd = larg->fd;
+    for (;;) {
+        int fd = accept(listenfd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return 0;
+        }
+        pthread_t thr;
+        ConnArg *carg = new ConnArg(fd, larg->latencyms);
+        if (pthread_create(&thr, 0, connWorker, carg)) {
+            delete carg;
+            close(fd);
+            continue;
+        }
+        pthread_detach(thr);
+    }
+}
+
+// Start a stand-in device. Returns its port, or -1
+static int startServer(int latencyms)
+{
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1024) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("bind/listen");
+        close(listenfd);
+        return -1;
+    }
+    pthread_t thr;
+    ConnArg *larg = new ConnArg(listenfd, latencyms);
+    if (pthread_create(&thr, 0, acceptWorker, larg)) {
+        perror("pthread_create");
+        delete larg;
+        close(listenfd);
+        return -1;
+    }
+    pthread_detach(thr);
+    return ntohs(addr.sin_port);
+}
+
+static bool checkResult(int ret, SoapIncoming& data)
+{
+    int track;
+    return ret == UPNP_E_SUCCESS && data.get("Track", &track);
+}
+
+// Synchronous round trips: each thread runs its share of the actions,
+// going over the devices in turn.
+class RTContext {
+public:
+    vector<Service*> *services;
+    int count;
+    int errors;
+    long long usecs;
+};
+
+static void *rtWorker(void *arg)
+{
+    RTContext *ctx = (RTContext *)arg;
+    for (int i = 0; i < ctx->count; i++) {
+        Service *service = (*ctx->services)[i % ctx->services->size()];
+        SoapOutgoing args(o_avt, "GetPositionInfo");
+        args("InstanceID", "0");
+        SoapIncoming data;
+        long long start = usecsnow();
+        int ret = service->runAction(args, data);
+        ctx->usecs += usecsnow() - start;
+        if (!checkResult(ret, data))
+            ctx->errors++;
+    }
+    return 0;
+}
+
+// Asynchronous round trips: all the actions are issued by the main
+// thread, and counted by the completion callbacks.
+static pthread_mutex_t o_asyncmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t o_asynccond = PTHREAD_COND_INITIALIZER;
+static int o_asyncdone;
+static int o_asyncerrors;
+static long long o_asyncusecs;
+
+static void asyncDone(long long start, int ret, SoapIncoming& data)
+{
+    bool ok = checkResult(ret, data);
+    pthread_mutex_lock(&o_asyncmutex);
+    o_asyncusecs += usecsnow() - start;
+    if (!ok)
+        o_asyncerrors++;
+    o_asyncdone++;
+    pthread_cond_broadcast(&o_asynccond);
+    pthread_mutex_unlock(&o_asyncmutex);
+}
+
+static void runAsync(vector<Service*>& services, int count)
+{
+    SoapOutgoing args(o_avt, "GetPositionInfo");
+    args("InstanceID", "0");
+    int queued = 0;
+    for (int i = 0; i < count; i++) {
+        long long start = usecsnow();
+        if (services[i % services.size()]->runActionAsync(
+                args, [start](int ret, SoapIncoming& data) {
+                    asyncDone(start, ret, data);}))
+            queued++;
+    }
+    pthread_mutex_lock(&o_asyncmutex);
+    o_asyncerrors += count - queued;
+    while (o_asyncdone < queued)
+        pthread_cond_wait(&o_asynccond, &o_asyncmutex);
+    pthread_mutex_unlock(&o_asyncmutex);
+}
+
+// Batch round trips: the same action sent to all the devices through
+// an ActionBatch, count / ndevices times. Returns the mean batch time
+// in uS.
+static long long runBatches(vector<Service*>& services, int count,
+                            int deadlinems, int *done, int *errors)
+{
+    int nbatches = count / services.size();
+    if (nbatches == 0)
+        nbatches = 1;
+    long long usecs = 0;
+    for (int i = 0; i < nbatches; i++) {
+        ActionBatch batch;
+        for (auto it = services.begin(); it != services.end(); it++) {
+            SoapOutgoing args(o_avt, "GetPositionInfo");
+            args("InstanceID", "0");
+            batch.add(**it, args);
+        }
+        long long start = usecsnow();
+        batch.run(deadlinems);
+        usecs += usecsnow() - start;
+        for (unsigned int j = 0; j < batch.size(); j++) {
+            if (!checkResult(batch.status(j), batch.response(j)))
+                (*errors)++;
+        }
+        *done += batch.size();
+    }
+    return usecs / nbatches;
+}
+
+static int roundTrips(const vector<string>& urls, int count, int nthreads,
+                      bool keepalive, bool async, bool batch, int deadlinems)
+{
+    if (LibUPnP::getLibUPnP() == 0) {
+        cerr << "Can't initialize libupnp" << endl;
+        return 1;
+    }
+    SoapTransport::setEnabled(keepalive);
+
+    vector<Service*> services;
+    for (auto it = urls.begin(); it != urls.end(); it++) {
+        UPnPDeviceDesc device;
+        UPnPServiceDesc sdesc;
+        string::size_type slash = it->find('/', it->find("://") + 3);
+        device.URLBase = it->substr(0, slash + 1);
+        sdesc.serviceType = o_avt;
+        sdesc.controlURL = it->substr(slash);
+        services.push_back(new Service(device, sdesc));
+    }
+
+    int done = 0, errors = 0;
+    long long usecs = 0;
+    long long start = usecsnow();
+    long long batchusecs = 0;
+    if (batch) {
+        batchusecs = runBatches(services, count, deadlinems, &done, &errors);
+    } else if (async) {
+        runAsync(services, count);
+        done = count;
+        errors = o_asyncerrors;
+        usecs = o_asyncusecs;
+    } else {
+        vector<RTContext> ctxs(nthreads);
+        vector<pthread_t> thrs(nthreads);
+        for (int i = 0; i < nthreads; i++) {
+            ctxs[i].services = &services;
+            ctxs[i].count = count / nthreads;
+            ctxs[i].errors = 0;
+            ctxs[i].usecs = 0;
+            pthread_create(&thrs[i], 0, rtWorker, &ctxs[i]);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(thrs[i], 0);
+            done += ctxs[i].count;
+            errors += ctxs[i].errors;
+            usecs += ctxs[i].usecs;
+        }
+    }
+    long long elapsed = usecsnow() - start;
+
+    cout << "transport: " << (keepalive ? "keep-alive" : "libupnp") << 
+        " devices: " << urls.size() << " first url: " << urls[0] << endl;
+    cout << "actions: " << done << " errors " << errors << 
+        (batch ? " batch" : "") << (async || batch ? 
+                                    " async, pool threads " : " threads ") << 
+        nthreads << endl;
+    if (batch)
+        cout << "batch time: " << batchusecs << " uS" << endl;
+    if (done > 0) {
+        // For async, this includes the time spent waiting in the queues
+        if (!batch)
+            cout << "latency: " << usecs / done << " uS/action, ";
+        cout << "throughput: " << double(done) * 1e6 / double(elapsed) << 
+            " actions/S" << endl;
+    }
+    if (keepalive) {
+        SoapTransportStats st = SoapTransport::getStats();
+        cout << "connections: new " << st.connects << " reused " << 
+            st.reused << " retries " << st.retries << " waits " << 
+            st.waits << " faults " << st.faults << " errors " << 
+            st.errors << endl;
+    }
+    for (auto it = services.begin(); it != services.end(); it++)
+        delete *it;
+    return errors ? 1 : 0;
+}
+
+static char *thisprog;
+static char usage [] =
+"soapbench [options]\n"
+"  -n <count> : iterations over the set of calls (default 100000)\n"
+"  -v : print the encoded calls\n"
+"Action round trips:\n"
+"  -r <count> : run count GetPositionInfo actions instead\n"
+"  -L : use libupnp instead of the keep-alive transport\n"
+"  -u <url> : AVTransport control URL of a real device. Default: use a\n"
+"     local stand-in device.\n"
+"  -P <threads> : parallel clients (default 1). With -A: pool size\n"
+"  -m <n> : maximum connections (and async requests) per device\n"
+"     (default 2)\n"
+"  -A : issue the actions from one thread with runActionAsync()\n"
+"  -B : send the action to all the devices at once with ActionBatch\n"
+"  -T <mS> : deadline for each batch\n"
+"  -D <n> : number of stand-in devices (default 1)\n"
+"  -l <mS> : stand-in response latency\n"
+"  -S <mS> : response latency for the first stand-in device\n"
+"  -d <pct> : stand-in drops pct of the requests on reused connections\n"
+;
+static void Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    thisprog = argv[0];
+    int iters = 100000;
+    bool verbose = false;
+    int rtcount = 0;
+    int nthreads = 1;
+    bool keepalive = true;
+    bool async = false;
+    bool batch = false;
+    int deadlinems = -1;
+    int latencyms = 0;
+    int slowms = -1;
+    int ndevices = 1;
+    int perdevice = 2;
+    string url;
+
+    int c;
+    while ((c = getopt(argc, argv, "ABd:D:l:Lm:n:P:r:S:T:u:v")) != -1) {
+        switch (c) {
+        case 'A': async = true; break;
+        case 'B': batch = true; break;
+        case 'd': o_droppct = atoi(optarg); break;
+        case 'D': ndevices = atoi(optarg); break;
+        case 'l': latencyms = atoi(optarg); break;
+        case 'L': keepalive = false; break;
+        case 'm': perdevice = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        case 'P': nthreads = atoi(optarg); break;
+        case 'r': rtcount = atoi(optarg); break;
+        case 'S': slowms = atoi(optarg); break;
+        case 'T': deadlinems = atoi(optarg); break;
+        case 'u': url = optarg; break;
+        case 'v': verbose = true; break;
+        default: Usage();
+        }
+    }
+    if (optind != argc || iters <= 0 || nthreads <= 0 || ndevices <= 0 ||
+        perdevice <= 0)
+        Usage();
+
+    if (rtcount > 0) {
+        SoapTransport::setMaxPerHost(perdevice);
+        Service::setAsyncLimits(perdevice, nthreads);
+        vector<string> urls;
+        if (!url.empty()) {
+            urls.push_back(url);
+        } else {
+            for (int i = 0; i < ndevices; i++) {
+                int port = startServer(i == 0 && slowms >= 0 ? 
+                                       slowms : latencyms);
+                if (port < 0)
+                    return 1;
+                ostringstream os;
+                os << "http://127.0.0.1:" << port << "/ctl/avt";
+                urls.push_back(os.str());
+            }
+        }
+        return roundTrips(urls, rtcount, nthreads, keepalive, async, batch,
+                          deadlinems);
+    }
+
+    vector<SoapOutgoing*> calls;
+    buildCalls(calls);
+
+    if (verbose) {
+        string buf;
+        for (auto it = calls.begin(); it != calls.end(); it++) {
+            domEncode(**it, buf);
+            cout << "DOM:    " << buf;
+            directEncode(**it, buf);
+            cout << "Direct: " << buf << endl;
+        }
+    }
+
+    // Warm up (and fill the template cache)
+    size_t bytes;
+    runBench(domEncode, calls, 100, &bytes);
+    runBench(directEncode, calls, 100, &bytes);
+
+    size_t dombytes, directbytes;
+    double dom = runBench(domEncode, calls, iters, &dombytes);
+    double direct = runBench(directEncode, calls, iters, &directbytes);
+
+    cout << "calls: " << iters * calls.size() << endl;
+    cout << "DOM:    " << dom << " nS/call, " <<
+        dombytes / (iters * calls.size()) << " bytes/call" << endl;
+    cout << "direct: " << direct << " nS/call, " <<
+        directbytes / (iters * calls.size()) << " bytes/call" << endl;
+    if (direct > 0)
+        cout << "speedup: " << dom / direct << endl;
+
+    for (auto it = calls.begin(); it != calls.end(); it++)
+        delete *it;
+    return 0;
+}
@@ -49,6 +49,12 @@ bool AVTransport::isAVTService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool AVTransport::isAVTService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 static AVTransport::TransportState stringToTpState(const string& s)
 {
     if (!stringuppercmp("STOPPED", s)) {
@@ -140,6 +140,9 @@ public:
 
     /** Test service type from discovery message */
     static bool isAVTService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isAVTService(const UPnPP::IString& st);
 
 protected:
     /* My service type string */
@@ -129,63 +129,51 @@ bool ContentDirectory::isCDService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
-static bool DSAccum(vector<CDSH>* out,
-                    const UPnPDeviceDesc& device, 
-                    const UPnPServiceDesc& service)
+bool ContentDirectory::isCDService(const IString& st)
 {
-    if (ContentDirectory::isCDService(service.serviceType)) {
-        out->push_back(CDSH(new ContentDirectory(device, service)));
-    }
-    return true;
+    static const IString base(IString(SType).base());
+    return st.base() == base;
 }
 
+// The handles come from the service registry, so that the UI can call
+// this often without creating and subscribing new objects each time.
 bool ContentDirectory::getServices(vector<CDSH>& vds)
 {
     //LOGDEB("UPnPDeviceDirectory::getDirServices" << endl);
-    UPnPDeviceDirectory::Visitor visitor = bind(DSAccum, &vds, _1, _2);
-    UPnPDeviceDirectory::getTheDir()->traverse(visitor);
+    vector<DDescH> devices;
+    UPnPDeviceDirectory::getTheDir()->getDevsByServiceType(SType, devices);
+    for (auto it = devices.begin(); it != devices.end(); it++) {
+        for (auto sit = (*it)->services.begin(); sit != (*it)->services.end(); 
+             sit++) {
+            if (isCDService(sit->serviceType)) {
+                CDSH cds = ServiceRegistry::get<ContentDirectory>(*it, *sit);
+                if (cds)
+                    vds.push_back(cds);
+            }
+        }
+    }
     return !vds.empty();
 }
 
 // Get server by friendly name. 
 bool ContentDirectory::getServerByName(const string& fname, CDSH& server)
 {
-    UPnPDeviceDesc ddesc;
+    DDescH ddesc;
     bool found = UPnPDeviceDirectory::getTheDir()->getDevByFName(fname, ddesc);
     if (!found)
         return false;
 
     found = false;
-    for (auto it = ddesc.services.begin(); it != ddesc.services.end(); it++) {
+    for (auto it = ddesc->services.begin(); it != ddesc->services.end(); it++) {
         if (isCDService(it->serviceType)) {
-            server = CDSH(new ContentDirectory(ddesc, *it));
-            found = true;
+            server = ServiceRegistry::get<ContentDirectory>(ddesc, *it);
+            found = server ? true : false;
             break;
         }
     }
     return found;
 }
 
-#if 0
-static int asyncReaddirCB(Upnp_EventType et, void *vev, void *cookie)
-{
-    LOGDEB("asyncReaddirCB: " << LibUPnP::evTypeAsString(et) << endl);
-    struct Upnp_Action_Complete *act = (struct Upnp_Action_Complete*)vev;
-
-    LOGDEB("asyncReaddirCB: errcode " << act->ErrCode << 
-           " cturl " <<  UpnpString_get_String(act->CtrlUrl) << 
-           " actionrequest " << endl << 
-           ixmlwPrintDoc(act->ActionRequest) << endl <<
-           " actionresult " << ixmlwPrintDoc(act->ActionResult) << endl);
-    return 0;
-}
-    int ret = 
-        UpnpSendActionAsync(hdl, getActionURL().c_str(), getServiceType().c_str(),
-        0 /*devUDN*/, request, asyncReaddirCB, 0);
-    sleep(10);
-    return -1;
-#endif
-
 void ContentDirectory::evtCallback(const unordered_map<string, string>&)
 {
 }
@@ -223,7 +211,7 @@ int ContentDirectory::readDirSlice(const string& objectId, int offset,
     string tbuf;
     if (!data.get("NumberReturned", didread) ||
         !data.get("TotalMatches", total) ||
-        !data.get("Result", &tbuf)) {
+        !data.take("Result", &tbuf)) {
         LOGERR("CDService::readDir: missing elts in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -297,7 +285,7 @@ int ContentDirectory::searchSlice(const string& objectId,
     string tbuf;
     if (!data.get("NumberReturned", didread) ||
         !data.get("TotalMatches", total) ||
-        !data.get("Result", &tbuf)) {
+        !data.take("Result", &tbuf)) {
         LOGERR("CDService::search: missing elts in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -388,7 +376,7 @@ int ContentDirectory::getMetadata(const string& objectId,
         return ret;
     }
     string tbuf;
-    if (!data.get("Result", &tbuf)) {
+    if (!data.take("Result", &tbuf)) {
         LOGERR("CDService::getmetadata: missing Result in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
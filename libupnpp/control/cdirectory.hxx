@@ -68,6 +68,11 @@ public:
 
     /** Test service type from discovery message */
     static bool isCDService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isCDService(const UPnPP::IString& st);
+    /** My service type string */
+    static const std::string SType;
 
     /** Retrieve the directory services currently seen on the network */
     static bool getServices(std::vector<CDSH>&);
@@ -142,10 +147,6 @@ public:
      */
     int getSearchCapabilities(std::set<std::string>& result);
 
-protected:
-    /* My service type string */
-    static const std::string SType;
-
 private:
     int m_rdreqcnt; // Slice size to use when reading
     ServiceKind m_serviceKind;
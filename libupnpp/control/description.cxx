@@ -21,25 +21,32 @@
 #include "description.hxx"
 
 #include <unordered_map>
+#include <functional>                   // for bind, _1, _2
+#include <memory>                       // for shared_ptr
 
+#include <pthread.h>                    // for pthread_cond_wait, etc
 #include <expat_external.h>             // for XML_Char
 #include <string.h>                     // for strcmp
-#include <upnp/upnp.h>                  // for UpnpDownload...
 
 #include "libupnpp/upnpplib.hxx"        
-#include "libupnpp/expatmm.hxx"         // for inputRefXMLParser
+#include "libupnpp/expatmm.hxx"         // for ExpatXMLParser
 #include "libupnpp/upnpp_p.hxx"         // for baseurl, trimstring
 #include "libupnpp/log.hxx"
+#include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
+#include "libupnpp/control/httpdownload.hxx"  // for downloadUrlWithCurl
 
 using namespace std;
+using namespace std::placeholders;
 using namespace UPnPP;
 
 namespace UPnPClient {
 
-class UPnPDeviceParser : public inputRefXMLParser {
+// The data is pushed into the parser (ParseChunk()), so the
+// read buffer is not used, but it has to exist.
+class UPnPDeviceParser : public ExpatXMLParser {
 public:
-    UPnPDeviceParser(const string& input, UPnPDeviceDesc& device)
-        : inputRefXMLParser(input), m_device(device)
+    UPnPDeviceParser(UPnPDeviceDesc& device)
+        : ExpatXMLParser(1), m_device(device)
         {}
 
 protected:
@@ -47,9 +54,18 @@ protected:
 	{
             m_tabs.push_back('\t');
             m_path.push_back(name);
+            m_chardata.clear();
 	}
     virtual void EndElement(const XML_Char *name)
 	{
+            // The character data may come in several pieces, only
+            // use it when the element is complete. The low
+            // cardinality fields are interned, so we don't want
+            // partial values in the table.
+            trimstring(m_chardata);
+            if (!m_chardata.empty())
+                setField(name, m_chardata);
+            m_chardata.clear();
             if (!strcmp(name, "service")) {
                 m_device.services.push_back(m_tservice);
                 m_tservice.clear();
@@ -62,86 +78,141 @@ protected:
 	{
             if (s == 0 || *s == 0)
                 return;
-            string str(s, len);
-            trimstring(str);
-            switch (m_path.back()[0]) {
+            m_chardata.append(s, len);
+	}
+
+    void setField(const string& name, const string& str)
+	{
+            switch (name[0]) {
             case 'c':
-                if (!m_path.back().compare("controlURL"))
+                if (!name.compare("controlURL"))
                     m_tservice.controlURL += str;
                 break;
             case 'd':
-                if (!m_path.back().compare("deviceType"))
-                    m_device.deviceType += str;
+                if (!name.compare("deviceType")) {
+                    if (isRootField())
+                        m_device.deviceType = str;
+                    else if (m_path.size() > 3)
+                        m_device.embeddedTypes.push_back(IString(str));
+                }
                 break;
             case 'e':
-                if (!m_path.back().compare("eventSubURL"))
+                if (!name.compare("eventSubURL"))
                     m_tservice.eventSubURL += str;
                 break;
             case 'f':
-                if (!m_path.back().compare("friendlyName"))
-                    m_device.friendlyName += str;
+                if (!name.compare("friendlyName") && isRootField())
+                    m_device.friendlyName = str;
                 break;
             case 'm':
-                if (!m_path.back().compare("manufacturer"))
-                    m_device.manufacturer += str;
-                else if (!m_path.back().compare("modelName"))
-                    m_device.modelName += str;
+                if (!isRootField())
+                    break;
+                if (!name.compare("manufacturer"))
+                    m_device.manufacturer = str;
+                else if (!name.compare("modelName"))
+                    m_device.modelName = str;
                 break;
             case 's':
-                if (!m_path.back().compare("serviceType"))
+                if (!name.compare("serviceType"))
                     m_tservice.serviceType = str;
-                else if (!m_path.back().compare("serviceId"))
-                    m_tservice.serviceId += str;
+                else if (!name.compare("serviceId"))
+                    m_tservice.serviceId = m_tservice.serviceId.str() + str;
+                break;
             case 'S':
-                if (!m_path.back().compare("SCPDURL"))
+                if (!name.compare("SCPDURL"))
                     m_tservice.SCPDURL = str;
                 break;
             case 'U':
-                if (!m_path.back().compare("UDN"))
-                    m_device.UDN = str;
-                else if (!m_path.back().compare("URLBase"))
+                // Embedded devices have their own UDN, the device is
+                // known by the root one.
+                if (!name.compare("UDN")) {
+                    if (isRootField())
+                        m_device.UDN = str;
+                }
+                else if (!name.compare("URLBase"))
                     m_device.URLBase += str;
                 break;
             }
 	}
 
+    // The device fields are those of the root device
+    // (root/device/xx). Only the types of the embedded devices are
+    // kept.
+    bool isRootField() const
+	{
+            return m_path.size() == 3;
+	}
+
 private:
     UPnPDeviceDesc& m_device;
     string m_tabs;
     std::vector<std::string> m_path;
+    string m_chardata;
     UPnPServiceDesc m_tservice;
 };
 
-UPnPDeviceDesc::UPnPDeviceDesc(const string& url, const string& description)
-    : ok(false)
+class UPnPDeviceDescParser::Internal {
+public:
+    Internal(const string& u, UPnPDeviceDesc& device)
+        : url(u), dev(device), parser(device) {}
+    string url;
+    UPnPDeviceDesc& dev;
+    UPnPDeviceParser parser;
+};
+
+UPnPDeviceDescParser::UPnPDeviceDescParser(const string& url, 
+                                           UPnPDeviceDesc& device)
+    : m(new Internal(url, device))
 {
-    //cerr << "UPnPDeviceDesc::UPnPDeviceDesc: url: " << url << endl;
-    //cerr << " description " << endl << description << endl;
+    device.ok = false;
+}
+
+UPnPDeviceDescParser::~UPnPDeviceDescParser()
+{
+    delete m;
+}
+
+bool UPnPDeviceDescParser::addData(const char *data, size_t len)
+{
+    return m->parser.ParseChunk(data, len);
+}
 
-    UPnPDeviceParser mparser(description, *this);
-    if (!mparser.Parse())
-        return;
-    if (URLBase.empty()) {
+bool UPnPDeviceDescParser::finish()
+{
+    if (!m->parser.ParseFinal())
+        return false;
+    if (m->dev.URLBase.empty()) {
         // The standard says that if the URLBase value is empty, we
         // should use the url the description was retrieved
         // from. However this is sometimes something like
         // http://host/desc.xml, sometimes something like http://host/
         // (rare, but e.g. sent by the server on a dlink nas).
-        URLBase = baseurl(url);
+        m->dev.URLBase = baseurl(m->url);
     }
-    ok = true;
+    m->dev.ok = true;
     //cerr << "URLBase: [" << URLBase << "]" << endl;
     //cerr << dump() << endl;
+    return true;
 }
 
+UPnPDeviceDesc::UPnPDeviceDesc(const string& url, const string& description)
+    : ok(false)
+{
+    //cerr << "UPnPDeviceDesc::UPnPDeviceDesc: url: " << url << endl;
+    //cerr << " description " << endl << description << endl;
 
+    UPnPDeviceDescParser mparser(url, *this);
+    if (mparser.addData(description.c_str(), description.size()))
+        mparser.finish();
+}
 
 
 // XML parser for the service description document (SCPDURL)
-class ServiceDescriptionParser : public inputRefXMLParser {
+// The data is pushed by the download (ParseChunk()).
+class ServiceDescriptionParser : public ExpatXMLParser {
 public:
-    ServiceDescriptionParser(UPnPServiceDesc::Parsed& out, const string& input)
-        : inputRefXMLParser(input), m_parsed(out)
+    ServiceDescriptionParser(UPnPServiceDesc::Parsed& out)
+        : ExpatXMLParser(1), m_parsed(out)
     {
     }
 
@@ -279,22 +350,213 @@ private:
     UPnPServiceDesc::StateVariable m_tvar;
 };
 
+// Timeout for downloading a service description
+static const long scpd_timeoutsecs = 10;
+
 bool UPnPServiceDesc::fetchAndParseDesc(const string& urlbase, 
                                         Parsed& parsed) const
 {
-    char *buf = 0;
-    char contentType[LINE_SIZE];
     string url = caturl(urlbase, SCPDURL);
-    int code = UpnpDownloadUrlItem(url.c_str(), &buf, contentType);
-    if (code != UPNP_E_SUCCESS) {
-        LOGERR("UPnPServiceDesc::fetchAndParseDesc: error fetching " << 
-               url << " : " << LibUPnP::errAsString("", code) << endl);
+    ServiceDescriptionParser parser(parsed);
+    // Parse the document as it comes. A parse error aborts the download.
+    if (!downloadUrlWithCurl(url, 
+                             [&parser](const char *data, size_t len) {
+                                 return parser.ParseChunk(data, len);
+                             }, scpd_timeoutsecs)) {
+        LOGERR("UPnPServiceDesc::fetchAndParseDesc: error fetching or "
+               "parsing " << url << endl);
         return false;
     }
-    string sdesc(buf);
-    free(buf);
-    ServiceDescriptionParser parser(parsed, sdesc);
-    return parser.Parse();
+    return parser.ParseFinal();
+}
+
+// State for a service description download in progress. The
+// document is parsed in the download thread as it arrives.
+class SCPDFetch {
+public:
+    SCPDFetch(const string& _url, const string& _modelkey)
+        : url(_url), modelkey(_modelkey),
+          parsed(new UPnPServiceDesc::Parsed), parser(*parsed)
+        {}
+    bool addData(const char *data, size_t len) {
+        return parser.ParseChunk(data, len);
+    }
+
+    string url;
+    string modelkey;
+    shared_ptr<UPnPServiceDesc::Parsed> parsed;
+    ServiceDescriptionParser parser;
+    // Completion functions from prefetch() calls
+    vector<SCPDCache::ReadyCB> cbs;
+};
+
+static PTMutexInit o_scpd_mutex;
+// Broadcast when a download completes, for the threads blocked in get()
+static pthread_cond_t o_scpd_cond = PTHREAD_COND_INITIALIZER;
+static unordered_map<string, SCPDCache::ParsedH> o_scpd_byurl;
+static unordered_map<string, SCPDCache::ParsedH> o_scpd_bymodel;
+static unordered_map<string, SCPDFetch*> o_scpd_pending;
+static bool o_scpd_sharebymodel = true;
+// Created on first use, and never deleted.
+static CurlMultiFetcher *o_scpd_fetcher;
+static const int scpd_maxparallel = 4;
+
+static string scpdModelKey(const UPnPDeviceDesc& device,
+                           const UPnPServiceDesc& service)
+{
+    if (device.manufacturer.empty() || device.modelName.empty())
+        return string();
+    return device.manufacturer.str() + "\n" + device.modelName.str() + "\n" +
+        service.serviceType.str();
+}
+
+// Call with the cache locked
+static SCPDCache::ParsedH scpdLookup(const string& url, const string& mkey)
+{
+    auto it = o_scpd_byurl.find(url);
+    if (it != o_scpd_byurl.end())
+        return it->second;
+    if (o_scpd_sharebymodel && !mkey.empty()) {
+        it = o_scpd_bymodel.find(mkey);
+        if (it != o_scpd_bymodel.end()) {
+            o_scpd_byurl[url] = it->second;
+            return it->second;
+        }
+    }
+    return SCPDCache::ParsedH();
+}
+
+// Called from the download thread
+static void scpdFetched(SCPDFetch *fp, const string& url,
+                        CurlMultiFetcher::FetchResult& res)
+{
+    SCPDCache::ParsedH parsed;
+    if (res.ok && fp->parser.ParseFinal()) {
+        parsed = fp->parsed;
+    } else {
+        LOGERR("SCPDCache: error fetching or parsing " << url << endl);
+    }
+
+    vector<SCPDCache::ReadyCB> cbs;
+    {
+        PTMutexLocker lock(o_scpd_mutex);
+        o_scpd_pending.erase(url);
+        if (parsed) {
+            o_scpd_byurl[url] = parsed;
+            if (!fp->modelkey.empty())
+                o_scpd_bymodel[fp->modelkey] = parsed;
+        }
+        cbs.swap(fp->cbs);
+        pthread_cond_broadcast(&o_scpd_cond);
+    }
+    delete fp;
+    for (auto it = cbs.begin(); it != cbs.end(); it++) {
+        (*it)(parsed);
+    }
+}
+
+// Call with the cache locked. Returns false if the download could not
+// be started, in which case nothing was queued.
+static bool scpdStartFetch(const string& url, const string& mkey,
+                           SCPDCache::ReadyCB cb)
+{
+    auto it = o_scpd_pending.find(url);
+    if (it != o_scpd_pending.end()) {
+        if (cb)
+            it->second->cbs.push_back(cb);
+        return true;
+    }
+    if (o_scpd_fetcher == 0) {
+        o_scpd_fetcher = new CurlMultiFetcher(scpd_maxparallel,
+                                              scpd_timeoutsecs);
+        if (!o_scpd_fetcher->start()) {
+            LOGERR("SCPDCache: can't start the download thread" << endl);
+            delete o_scpd_fetcher;
+            o_scpd_fetcher = 0;
+            return false;
+        }
+    }
+    SCPDFetch *fp = new SCPDFetch(url, mkey);
+    if (cb)
+        fp->cbs.push_back(cb);
+    if (!o_scpd_fetcher->fetch(url, bind(scpdFetched, fp, _1, _2), 
+                               string(), string(),
+                               bind(&SCPDFetch::addData, fp, _1, _2))) {
+        LOGERR("SCPDCache: can't queue download for " << url << endl);
+        delete fp;
+        return false;
+    }
+    o_scpd_pending[url] = fp;
+    return true;
+}
+
+SCPDCache::ParsedH SCPDCache::get(const UPnPDeviceDesc& device,
+                                  const UPnPServiceDesc& service)
+{
+    string url = caturl(device.URLBase, service.SCPDURL);
+    string mkey = scpdModelKey(device, service);
+    {
+        PTMutexLocker lock(o_scpd_mutex);
+        ParsedH parsed = scpdLookup(url, mkey);
+        if (parsed)
+            return parsed;
+        if (scpdStartFetch(url, mkey, ReadyCB())) {
+            // The download thread always completes the request, if
+            // only by timing out.
+            while (o_scpd_pending.find(url) != o_scpd_pending.end()) {
+                pthread_cond_wait(&o_scpd_cond, lock.getMutex());
+            }
+            return scpdLookup(url, mkey);
+        }
+    }
+
+    // No download thread: do it ourselves.
+    shared_ptr<UPnPServiceDesc::Parsed> parsed(new UPnPServiceDesc::Parsed);
+    if (!service.fetchAndParseDesc(device.URLBase, *parsed))
+        return ParsedH();
+    PTMutexLocker lock(o_scpd_mutex);
+    o_scpd_byurl[url] = parsed;
+    if (!mkey.empty())
+        o_scpd_bymodel[mkey] = parsed;
+    return parsed;
+}
+
+SCPDCache::ParsedH SCPDCache::find(const UPnPDeviceDesc& device,
+                                   const UPnPServiceDesc& service)
+{
+    string url = caturl(device.URLBase, service.SCPDURL);
+    PTMutexLocker lock(o_scpd_mutex);
+    return scpdLookup(url, scpdModelKey(device, service));
+}
+
+void SCPDCache::prefetch(const UPnPDeviceDesc& device,
+                         const UPnPServiceDesc& service, ReadyCB cb)
+{
+    string url = caturl(device.URLBase, service.SCPDURL);
+    string mkey = scpdModelKey(device, service);
+    ParsedH parsed;
+    {
+        PTMutexLocker lock(o_scpd_mutex);
+        parsed = scpdLookup(url, mkey);
+        if (!parsed && scpdStartFetch(url, mkey, cb))
+            return;
+    }
+    // Cached, or error
+    if (cb)
+        cb(parsed);
+}
+
+void SCPDCache::setShareByModel(bool onoff)
+{
+    PTMutexLocker lock(o_scpd_mutex);
+    o_scpd_sharebymodel = onoff;
+}
+
+void SCPDCache::clear()
+{
+    PTMutexLocker lock(o_scpd_mutex);
+    o_scpd_byurl.clear();
+    o_scpd_bymodel.clear();
 }
 
 } // namespace
@@ -26,19 +26,26 @@
 #include <unordered_map>
 #include <string>
 #include <sstream>
+#include <memory>
+#include <functional>
+
+#include "libupnpp/istring.hxx"
 
 namespace UPnPClient {
 
 /**
  * Data holder for a UPnP service, parsed from the XML description
  * downloaded after discovery yielded its URL.
+ *
+ * The type and id fields are interned (see UPnPP::IString): they have
+ * few distinct values, and are shared between all the devices.
  */
 class UPnPServiceDesc {
 public:
     // e.g. urn:schemas-upnp-org:service:ConnectionManager:1
-    std::string serviceType;
+    UPnPP::IString serviceType;
     // Unique Id inside device: e.g here THE ConnectionManager
-    std::string serviceId; // e.g. urn:upnp-org:serviceId:ConnectionManager
+    UPnPP::IString serviceId; // e.g. urn:upnp-org:serviceId:ConnectionManager
     std::string SCPDURL; // Service description URL. e.g.: cm.xml
     std::string controlURL; // e.g.: /upnp/control/cm
     std::string eventSubURL; // e.g.: /upnp/event/cm
@@ -102,7 +109,11 @@ public:
         std::unordered_map<std::string, StateVariable> stateTable;
     };
     
-    bool fetchAndParseDesc(const std::string&, Parsed& parsed) const;
+    /** Download and parse the service description (SCPD). The document
+     * is parsed as it arrives. 
+     * @param urlbase the device URLBase, to which SCPDURL is relative.
+     */
+    bool fetchAndParseDesc(const std::string& urlbase, Parsed& parsed) const;
 };
 
 /**
@@ -110,6 +121,7 @@ public:
  * during discovery.
  * A device may include several services. To be of interest to us,
  * one of them must be a ContentDirectory.
+ * The type, manufacturer and model fields are interned.
  */
 class UPnPDeviceDesc {
 public:
@@ -123,7 +135,7 @@ public:
 
     bool ok;
     // e.g. urn:schemas-upnp-org:device:MediaServer:1
-    std::string deviceType;
+    UPnPP::IString deviceType;
     // e.g. MediaTomb
     std::string friendlyName;
     // Unique device number. This should match the deviceID in the
@@ -132,20 +144,41 @@ public:
     // Base for all relative URLs. e.g. http://192.168.4.4:49152/
     std::string URLBase;
     // Manufacturer: e.g. D-Link, PacketVideo ("manufacturer")
-    std::string manufacturer;
+    UPnPP::IString manufacturer;
     // Model name: e.g. MediaTomb, DNS-327L ("modelName")
-    std::string modelName;
+    UPnPP::IString modelName;
+
+    // Types of the embedded devices, if any. The other fields
+    // describe the root device.
+    std::vector<UPnPP::IString> embeddedTypes;
 
-    // Services provided by this device.
+    // Services provided by this device and the embedded ones.
     std::vector<UPnPServiceDesc> services;
 
+    /** Check the root and embedded device types, ignoring the
+     * versions. @param tp type without the version part. */
+    bool hasDeviceType(const std::string& tp) const
+    {
+        if (!tp.compare(deviceType.base().str()))
+            return true;
+        for (auto it = embeddedTypes.begin(); it != embeddedTypes.end(); it++){
+            if (!tp.compare(it->base().str()))
+                return true;
+        }
+        return false;
+    }
+
     std::string dump() const
     {
         std::ostringstream os;
         os << "DEVICE " << " {deviceType [" << deviceType <<
             "] friendlyName [" << friendlyName <<
             "] UDN [" << UDN <<
-            "] URLBase [" << URLBase << "] Services:" << std::endl;
+            "] URLBase [" << URLBase << "]";
+        for (auto it = embeddedTypes.begin(); it != embeddedTypes.end(); it++){
+            os << " embedded [" << *it << "]";
+        }
+        os << " Services:" << std::endl;
         for (auto it = services.begin(); it != services.end(); it++) {
             os << "    " << it->dump();
         }
@@ -156,6 +189,81 @@ public:
 
 typedef std::vector<UPnPServiceDesc>::iterator DevServIt;
 
+/**
+ * Incremental device description parser, for building the description
+ * while the document is being downloaded, without buffering it.
+ */
+class UPnPDeviceDescParser {
+public:
+    /** 
+     * @param url where the description comes from, used for the
+     *    URLBase default.
+     * @param device the object to fill up. It must stay around until
+     *    finish() is called.
+     */
+    UPnPDeviceDescParser(const std::string& url, UPnPDeviceDesc& device);
+    ~UPnPDeviceDescParser();
+
+    /** Parse a piece of the document. Returns false after an error */
+    bool addData(const char *data, size_t len);
+
+    /** Call after the last piece. This completes the description and
+     * sets its ok flag if the whole document was parsed. */
+    bool finish();
+
+private:
+    class Internal;
+    Internal *m;
+
+    UPnPDeviceDescParser(const UPnPDeviceDescParser&) = delete;
+    UPnPDeviceDescParser& operator=(const UPnPDeviceDescParser&) = delete;
+};
+
+/**
+ * Process-wide cache of parsed service descriptions (SCPD).
+ *
+ * Entries are indexed by SCPD URL. Devices of the same model usually
+ * have identical descriptions, so an entry can also be found by
+ * manufacturer, model name and service type (this can be turned off
+ * with setShareByModel()). The cache is never purged, the documents
+ * are few and small.
+ *
+ * Downloads are performed by a background thread, and concurrent
+ * requests for the same document share a single transfer.
+ */
+class SCPDCache {
+public:
+    typedef std::shared_ptr<const UPnPServiceDesc::Parsed> ParsedH;
+    typedef std::function<void (ParsedH)> ReadyCB;
+
+    /** Return the parsed description, downloading it if it is not
+     * in the cache. This blocks until the transfer is done or timed
+     * out. Returns a null pointer in case of error. */
+    static ParsedH get(const UPnPDeviceDesc& device,
+                       const UPnPServiceDesc& service);
+
+    /** Cache lookup only. Never blocks. */
+    static ParsedH find(const UPnPDeviceDesc& device,
+                        const UPnPServiceDesc& service);
+
+    /** Start downloading the description in the background if it is
+     * not already cached or being downloaded.
+     * @param cb if set, called with the result (null in case of error),
+     *   either immediately from the calling thread if the entry was
+     *   cached, or later from the download thread. It should not block.
+     */
+    static void prefetch(const UPnPDeviceDesc& device,
+                         const UPnPServiceDesc& service,
+                         ReadyCB cb = ReadyCB());
+
+    /** Let devices with the same manufacturer, model name and service 
+     * type share their descriptions. Default: true. */
+    static void setShareByModel(bool onoff);
+
+    /** Forget everything. */
+    static void clear();
+};
+
 } // namespace
 
 #endif /* _UPNPDEV_HXX_INCLUDED_ */
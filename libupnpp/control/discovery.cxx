@@ -18,6 +18,7 @@
 
 #include "discovery.hxx"
 
+#include <errno.h>                      // for ETIMEDOUT
 #include <pthread.h>                    // for pthread_cond_broadcast, etc
 #include <sched.h>                      // for sched_yield
 #include <stdlib.h>                     // for free
@@ -34,20 +35,30 @@
 #include <upnp/upnp.h>                  // for Upnp_Discovery, etc
 
 #include <functional>                   // for _Bind, bind, function, _1, etc
+#include <fstream>                      // for ifstream, ofstream
 #include <iostream>                     // for operator<<, basic_ostream, etc
+#include <sstream>                      // for istringstream
+#include <limits>                       // for numeric_limits
 #include <map>                          // for _Rb_tree_iterator, map, etc
+#include <queue>                        // for priority_queue
+#include <set>                          // for set
 #include <utility>                      // for pair
 #include <vector>                       // for vector
+#include <memory>                       // for shared_ptr
+#include <unordered_map>
 #include <unordered_set>
 
 #include "description.hxx"              // for UPnPDeviceDesc, etc
 
 #include "libupnpp/log.hxx"             // for LOGDEB1, LOGERR, LOGDEB
+#include "libupnpp/md5.hxx"             // for MD5Init, etc
 #include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
+#include "libupnpp/upnpp_p.hxx"         // for typeNoVersion
 #include "libupnpp/upnpplib.hxx"        // for LibUPnP
 #include "libupnpp/upnpputils.hxx"      // for timespec_addnanos
 #include "libupnpp/workqueue.hxx"       // for WorkQueue
 #include "libupnpp/control/httpdownload.hxx"
+#include "libupnpp/control/service.hxx"  // for Service::terminateAsync
 
 using namespace std;
 using namespace std::placeholders;
@@ -79,30 +90,414 @@ static string cluDiscoveryToStr(const struct Upnp_Discovery *disco)
     return ss.str();
 }
 
+// Device and service types of interest (setInterest()), without the
+// versions. When not empty, we only download the descriptions for the
+// root devices which announce one of these.
+static unordered_set<string> o_interest;
+// Same, with versions, for the searches
+static vector<string> o_interestTypes;
+
+static bool isInteresting(const UPnPDeviceDesc& dev)
+{
+    if (o_interest.find(dev.deviceType.base().str()) != o_interest.end())
+        return true;
+    for (auto it = dev.embeddedTypes.begin(); it != dev.embeddedTypes.end();
+         it++) {
+        if (o_interest.find(it->base().str()) != o_interest.end())
+            return true;
+    }
+    for (auto it = dev.services.begin(); it != dev.services.end(); it++) {
+        if (o_interest.find(it->serviceType.base().str()) != 
+            o_interest.end())
+            return true;
+    }
+    return false;
+}
+
+// Activity counters (getStats()). The updates are cheap enough that
+// we don't bother making them optional.
+static DiscoveryStats o_stats;
+static PTMutexInit o_stats_mutex;
+#define STATINC(F) {PTMutexLocker statlock(o_stats_mutex); o_stats.F++;}
+
+static void stathist(DiscoveryStats::Histogram DiscoveryStats::*h, long long v)
+{
+    PTMutexLocker lock(o_stats_mutex);
+    (o_stats.*h).add(v);
+}
+
 // Each appropriate discovery event (executing in a libupnp thread
 // context) queues the following task object for processing by the
 // discovery thread.
 class DiscoveredTask {
 public:
     DiscoveredTask(bool _alive, const struct Upnp_Discovery *disco)
-        : alive(_alive), url(disco->Location), deviceId(disco->DeviceId),
-          expires(disco->Expires)
+        : alive(_alive), refresh(false), url(disco->Location), 
+          deviceId(disco->DeviceId), expires(disco->Expires),
+          parser(0), nbytes(0), parseus(0), queued(0), fetchstart(0)
         {}
+    ~DiscoveredTask() {
+        delete parser;
+    }
+
+    // Called from the fetcher thread for each piece of the description
+    // document as it arrives: the parsing is done while the transfer
+    // is going on, and the document is never stored whole.
+    bool addData(const char *data, size_t len) {
+        if (parser == 0) {
+            MD5Init(&md5ctx);
+            building = std::make_shared<UPnPDeviceDesc>();
+            parser = new UPnPDeviceDescParser(url, *building);
+        }
+        nbytes += len;
+        MD5Update(&md5ctx, (const unsigned char *)data, len);
+        long long start = usecsnow();
+        // Keep going even if the parse failed: the hash may tell us
+        // that we already have good data for this document.
+        parser->addData(data, len);
+        parseus += usecsnow() - start;
+        return true;
+    }
 
     bool alive;
+    // Device already known and description unchanged: just update
+    // the last seen time.
+    bool refresh;
     string url;
-    string description;
+    // MD5 of the raw document
+    string hash;
+    // Parsed description, from the cache or from the download
+    DDescH parsed;
     string deviceId;
     int expires; // Seconds valid
+    // Incremental parse and hash state for the download
+    std::shared_ptr<UPnPDeviceDesc> building;
+    UPnPDeviceDescParser *parser;
+    MD5_CTX md5ctx;
+    size_t nbytes;
+    long long parseus;
+    // Timestamps (uS) for the statistics
+    long long queued;
+    long long fetchstart;
+private:
+    DiscoveredTask(const DiscoveredTask&) = delete;
+    DiscoveredTask& operator=(const DiscoveredTask&) = delete;
+};
+
+// Description documents cache, indexed by location URL. This allows
+// skipping both the download and the parsing when a device
+// re-announces itself, and making the download conditional when we
+// do need to check for changes.
+class DescCacheEntry {
+public:
+    DescCacheEntry() : validated(0), last_seen(0), interesting(false),
+                       failed(0), nfailures(0) {}
+    // MD5 of the raw document
+    string hash;
+    // Validators from the last download
+    string etag;
+    string lastmodified;
+    // Parsed description. May be null if parsing is still pending.
+    DDescH parsed;
+    // Time of the last download (full or conditional)
+    time_t validated;
+    // Time the document was last referenced by a discovery message
+    time_t last_seen;
+    // Root device id for this location, from the root device
+    // messages or the parsed description. Lets us attribute the
+    // messages about embedded devices and services to the right pool
+    // entry.
+    string deviceId;
+    // Some message for this location had a type of interest (only
+    // used if an interest filter is set).
+    bool interesting;
+    // Time of the last parse failure, and count of successive
+    // failures, for delaying the next download (fetchBackoff()).
+    time_t failed;
+    int nfailures;
 };
+static unordered_map<string, DescCacheEntry> o_desccache;
+static PTMutexInit o_desccache_mutex;
+// Entries not referenced for this long are purged from the cache
+static const int o_desccache_maxidle = 3600;
+// Interval for purging the description cache and the recent
+// announcements table, done by the expiry thread.
+static const int o_purgeInterval = 60;
+// Delay before downloading again a description which could not be
+// parsed. Doubled after each failure, up to the maximum.
+static const int o_failRetryMin = 30;
+static const int o_failRetryMax = 1800;
 
-// The workqueue on which callbacks from libupnp (cluCallBack()) queue
+// The workqueues on which callbacks from libupnp (cluCallBack()) queue
 // discovered object descriptors for processing by our dedicated
-// thread.
-static WorkQueue<DiscoveredTask*> discoveredQueue("DiscoveredQueue");
+// threads. Each queue has one worker. The tasks are dispatched by
+// device id, so that the messages for a given device are processed
+// in order, while different devices are processed in parallel.
+static vector<WorkQueue<DiscoveredTask*>*> o_discoveredQueues;
+static int o_discoWorkers = 4;
+
+static bool queueDiscoveredTask(DiscoveredTask *tp)
+{
+    if (o_discoveredQueues.empty())
+        return false;
+    size_t idx = std::hash<string>()(tp->deviceId) % o_discoveredQueues.size();
+    tp->queued = usecsnow();
+    if (!o_discoveredQueues[idx]->put(tp))
+        return false;
+    long long depth = o_discoveredQueues[idx]->qsize();
+    PTMutexLocker lock(o_stats_mutex);
+    if (depth > o_stats.maxQueueDepth)
+        o_stats.maxQueueDepth = depth;
+    return true;
+}
 static unordered_set<string> o_downloading;
 static PTMutexInit o_downloading_mutex;
 
+// The description documents are downloaded by a curl multi
+// fetcher, so that the libupnp callback threads are never blocked
+// by a slow device, and many downloads can run in parallel.
+static CurlMultiFetcher *o_fetcher;
+static int o_fetchParallel = 20;
+static int o_fetchTimeout = 5;
+
+// Called from the fetcher thread when a description download is done.
+static void descFetched(DiscoveredTask *tp, const string& url,
+                        CurlMultiFetcher::FetchResult& res)
+{
+    {PTMutexLocker lock(o_downloading_mutex);
+        o_downloading.erase(url);
+    }
+    if (!res.ok) {
+        LOGERR("discovery: description download failed for: " << url << endl);
+        STATINC(downloadErrors);
+        delete tp;
+        return;
+    }
+    bool notmodified = res.httpcode == 304;
+    if (!notmodified && tp->parser) {
+        // Complete the parse and the hash. The parse result is only
+        // used if the document changed.
+        long long start = usecsnow();
+        tp->parser->finish();
+        tp->parseus += usecsnow() - start;
+        MD5Final(tp->hash, &tp->md5ctx);
+    }
+    {
+        PTMutexLocker lock(o_stats_mutex);
+        o_stats.downloadMs.add((usecsnow() - tp->fetchstart) / 1000);
+        if (notmodified) {
+            o_stats.notModified++;
+        } else {
+            o_stats.downloadBytes.add(tp->nbytes);
+        }
+    }
+
+    bool parseerror = false;
+    {
+        PTMutexLocker lock(o_desccache_mutex);
+        DescCacheEntry& entry = o_desccache[url];
+        entry.validated = entry.last_seen = time(0);
+        if (notmodified) {
+            LOGDEB1("discovery: description not modified: " << url << endl);
+            tp->parsed = entry.parsed;
+        } else {
+            LOGDEB1("discovery: downloaded description document of " <<
+                    tp->nbytes << " bytes" << endl);
+            if (entry.parsed && tp->parser && tp->hash == entry.hash) {
+                // Server does not do conditional requests, but the
+                // data is the same: keep the existing object.
+                tp->parsed = entry.parsed;
+            } else if (tp->building && tp->building->ok) {
+                stathist(&DiscoveryStats::parseUs, tp->parseus);
+                tp->parsed = tp->building;
+                entry.parsed = tp->parsed;
+                entry.hash = tp->hash;
+            } else {
+                // Keep the entry (interest, root device id), but
+                // forget the document, and don't download it again
+                // until the retry delay has elapsed.
+                parseerror = true;
+                entry.parsed.reset();
+                entry.hash.clear();
+                entry.etag.clear();
+                entry.lastmodified.clear();
+                entry.failed = entry.validated;
+                entry.nfailures++;
+            }
+            if (!parseerror) {
+                entry.etag = res.etag;
+                entry.lastmodified = res.lastmodified;
+                entry.failed = 0;
+                entry.nfailures = 0;
+            }
+        }
+        // Remember the root device for the location, so that the
+        // messages about its embedded devices and services can be
+        // attributed to it.
+        if (!parseerror && tp->parsed && !tp->parsed->UDN.empty())
+            entry.deviceId = tp->parsed->UDN;
+    }
+    delete tp->parser;
+    tp->parser = 0;
+    tp->building.reset();
+
+    if (parseerror) {
+        LOGERR("discovery: description parse failed for " << url << endl);
+        delete tp;
+        return;
+    }
+    if (!tp->parsed) {
+        // 304 on an entry which was never successfully parsed ??
+        LOGERR("discovery: no description data for " << url << endl);
+        delete tp;
+        return;
+    }
+    // The pool is indexed by root device UDN. The message may have
+    // been about an embedded device or a service, with a different id.
+    if (!tp->parsed->UDN.empty())
+        tp->deviceId = tp->parsed->UDN;
+    if (!queueDiscoveredTask(tp)) {
+        delete tp;
+    }
+}
+
+static bool inPool(const string& deviceId);
+static bool refreshInPool(const string& deviceId, int expires);
+
+// Root device id for a discovery message. For embedded devices and
+// services, the message DeviceId is their own UDN, and we use the
+// root id recorded for the description location, if we know
+// it. Returns an empty string else.
+static string rootDeviceId(const struct Upnp_Discovery *disco, bool isroot)
+{
+    if (isroot)
+        return disco->DeviceId;
+    PTMutexLocker lock(o_desccache_mutex);
+    auto it = o_desccache.find(disco->Location);
+    return it == o_desccache.end() ? string() : it->second.deviceId;
+}
+
+// With an interest filter, decide if a discovery message is worth
+// processing. Typed messages (embedded devices and services) are
+// checked against the filter and mark their location as
+// interesting. Root device messages are only processed for locations
+// already known to be interesting.
+static bool wantMessage(const struct Upnp_Discovery *disco, bool isroot)
+{
+    if (isroot) {
+        PTMutexLocker lock(o_desccache_mutex);
+        auto it = o_desccache.find(disco->Location);
+        return it != o_desccache.end() && it->second.interesting;
+    } 
+    const char *tp = disco->ServiceType[0] ? disco->ServiceType : 
+        disco->DeviceType;
+    if (o_interest.find(typeNoVersion(tp)) == o_interest.end())
+        return false;
+    PTMutexLocker lock(o_desccache_mutex);
+    o_desccache[disco->Location].interesting = true;
+    return true;
+}
+
+// Announcement coalescing: devices send bursts of messages (for the
+// root, embedded devices and services, repeated a few times, plus
+// search answers). Once we have processed one for a device, the
+// others within the window just refresh the pool entry, without
+// going through the queue.
+static int o_coalesceWindow = 5;
+static unordered_map<string, time_t> o_recent;
+static PTMutexInit o_recent_mutex;
+
+// rootid is the root device id for the message (rootDeviceId()).
+static bool coalesced(const string& rootid, int expires)
+{
+    if (o_coalesceWindow <= 0 || rootid.empty())
+        return false;
+    time_t now = time(0);
+    {
+        PTMutexLocker lock(o_recent_mutex);
+        time_t& last = o_recent[rootid];
+        if (now - last >= o_coalesceWindow) {
+            last = now;
+            return false;
+        }
+    }
+    return refreshInPool(rootid, expires);
+}
+
+// Decide if we need to fetch the description for a device
+// announcement.  We don't if the device is in the pool, and its
+// description was checked less than max-age seconds ago. Else, we
+// return the validators to use for a conditional request.
+// For messages about embedded devices or services (from a typed
+// search), deviceId is set to the root device id if we know it.
+static bool needFetch(const struct Upnp_Discovery *disco, bool isroot,
+                      string& deviceId, string& etag, string& lastmodified)
+{
+    time_t now = time(0);
+    bool fresh = false;
+    {
+        PTMutexLocker lock(o_desccache_mutex);
+        DescCacheEntry& entry = o_desccache[disco->Location];
+        entry.last_seen = now;
+        if (isroot) {
+            entry.deviceId = disco->DeviceId;
+        } else if (!entry.deviceId.empty()) {
+            deviceId = entry.deviceId;
+        }
+        if (!entry.parsed)
+            return true;
+        fresh = now - entry.validated < disco->Expires && 
+            (isroot ? !entry.parsed->UDN.compare(disco->DeviceId) :
+             !entry.deviceId.empty());
+        etag = entry.etag;
+        lastmodified = entry.lastmodified;
+    }
+    // Don't hold the cache lock while locking the pool
+    if (fresh && inPool(deviceId))
+        return false;
+    return true;
+}
+
+// Check if the description for a location recently failed to parse,
+// in which case we don't download it again before the retry delay.
+static bool fetchBackoff(const string& url)
+{
+    time_t now = time(0);
+    PTMutexLocker lock(o_desccache_mutex);
+    auto it = o_desccache.find(url);
+    if (it == o_desccache.end() || it->second.nfailures == 0)
+        return false;
+    DescCacheEntry& entry = it->second;
+    entry.last_seen = now;
+    int shift = min(entry.nfailures - 1, 10);
+    int delay = min(o_failRetryMin << shift, o_failRetryMax);
+    return now - entry.failed < delay;
+}
+
+// Get rid of cache entries for devices not seen for a long time.
+static void purgeDescCache()
+{
+    time_t now = time(0);
+    {
+        PTMutexLocker lock(o_desccache_mutex);
+        for (auto it = o_desccache.begin(); it != o_desccache.end();) {
+            if (now - it->second.last_seen > o_desccache_maxidle) {
+                it = o_desccache.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    PTMutexLocker lock(o_recent_mutex);
+    for (auto it = o_recent.begin(); it != o_recent.end();) {
+        if (now - it->second >= o_coalesceWindow) {
+            it = o_recent.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
 // This gets called in a libupnp thread context for all asynchronous
 // events which we asked for.
 // Example: ContentDirectories appearing and disappearing from the network
@@ -116,13 +511,37 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
     case UPNP_DISCOVERY_SEARCH_RESULT:
     case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
     {
+        if (et == UPNP_DISCOVERY_SEARCH_RESULT) {
+            STATINC(searchResults);
+        } else {
+            STATINC(alives);
+        }
         struct Upnp_Discovery *disco = (struct Upnp_Discovery *)evp;
         // Devices send multiple messages for themselves, their subdevices and 
         // services. AFAIK they all point to the same description.xml document,
         // which has all the interesting data. So let's try to only process
         // one message per device: the one which probably correspond to the 
-        // upnp "root device" message and has empty service and device types:
-        if (!disco->DeviceType[0] && !disco->ServiceType[0]) {
+        // upnp "root device" message and has empty service and device types.
+        // Search results are always processed: they may be answers to a
+        // targeted search (searchFor()) and there will be no root message.
+        // With an interest filter, we use the typed messages instead,
+        // so that we never download the descriptions for other devices.
+        bool isroot = !disco->DeviceType[0] && !disco->ServiceType[0];
+        bool process = o_interest.empty() ? 
+            (isroot || et == UPNP_DISCOVERY_SEARCH_RESULT) : 
+            wantMessage(disco, isroot);
+        string rootid;
+        if (process)
+            rootid = rootDeviceId(disco, isroot);
+        if (!process) {
+            STATINC(ignored);
+        } else if (coalesced(rootid, disco->Expires)) {
+            LOGDEB1("discovery:cllb: coalesced message for " << 
+                    disco->DeviceId << endl);
+            STATINC(coalesced);
+            return UPNP_E_SUCCESS;
+        }
+        if (process) {
             LOGDEB1("discovery:cllb:ALIVE: " << cluDiscoveryToStr(disco) 
                    << endl);
             // Device signals its existence and well-being. Perform the
@@ -130,25 +549,62 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
             // description document.
 
             DiscoveredTask *tp = new DiscoveredTask(1, disco);
+            // Messages about embedded devices and services (e.g. answers
+            // to a targeted search) are attributed to the root device
+            // if we know it. Else this is done once the description
+            // is parsed.
+            if (!rootid.empty())
+                tp->deviceId = rootid;
+
+            if (fetchBackoff(tp->url)) {
+                LOGDEB1("discovery:cllb: bad description, retry later: " <<
+                        tp->url << endl);
+                STATINC(ignored);
+                delete tp;
+                return UPNP_E_SUCCESS;
+            }
+
+            string etag, lastmodified;
+            if (!needFetch(disco, isroot, tp->deviceId, etag, lastmodified)) {
+                LOGDEB1("discovery:cllb: known device, refresh only: " <<
+                        tp->deviceId << endl);
+                tp->refresh = true;
+                STATINC(refreshes);
+                if (!queueDiscoveredTask(tp)) {
+                    delete tp;
+                    return UPNP_E_SUCCESS;
+                }
+                return UPNP_E_FINISH;
+            }
 
             {
                 // Note that this does not prevent multiple successive
                 // downloads of a normal url, just multiple
-                // simultaneous downloads of a slow one, to avoid
-                // tying up threads.
+                // simultaneous downloads of a slow one.
                 PTMutexLocker lock(o_downloading_mutex);
                 auto res = o_downloading.insert(tp->url);
                 if (!res.second) {
                     LOGDEB("discovery:cllb: already downloading " << 
                            tp->url << endl);
+                    STATINC(downloadDups);
+                    delete tp;
                     return UPNP_E_SUCCESS;
                 }
             }
 
-            LOGDEB("discoExplorer: downloading " << tp->url << endl);
-            string sdesc;
-            if (!downloadUrlWithCurl(tp->url, tp->description, 5)) {
-                LOGERR("discovery:cllb: downloadUrlWithCurl error for: " << 
+            // Don't download from here: we are running in a libupnp
+            // thread, and a slow or dead device would hold it up for
+            // the duration of the timeout. The fetcher thread will
+            // queue the task when done.
+            LOGDEB("discovery:cllb: queueing download for " << tp->url << 
+                   endl);
+            STATINC(downloads);
+            tp->fetchstart = usecsnow();
+            if (o_fetcher == 0 || 
+                !o_fetcher->fetch(tp->url, bind(descFetched, tp, _1, _2),
+                                  etag, lastmodified,
+                                  bind(&DiscoveredTask::addData, tp, _1, _2))) {
+                LOGERR("discovery:cllb: can't queue download for " << 
                        tp->url << endl);
                 {PTMutexLocker lock(o_downloading_mutex);
                     o_downloading.erase(tp->url);
@@ -156,31 +612,24 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
                 delete tp;
                 return UPNP_E_SUCCESS;
             }
-            LOGDEB1("discovery:cllb: downloaded description document of " <<
-                    tp->description.size() << " bytes" << endl);
-
-            {PTMutexLocker lock(o_downloading_mutex);
-                o_downloading.erase(tp->url);
-            }
-
-            if (discoveredQueue.put(tp)) {
-                return UPNP_E_FINISH;
-            }
+            return UPNP_E_FINISH;
         }
         break;
     }
     case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE:
     {
+        STATINC(byebyes);
         struct Upnp_Discovery *disco = (struct Upnp_Discovery *)evp;
         //LOGDEB("discovery:cllB:BYEBYE: " << cluDiscoveryToStr(disco) << endl);
         DiscoveredTask *tp = new DiscoveredTask(0, disco);
-        if (discoveredQueue.put(tp)) {
+        if (queueDiscoveredTask(tp)) {
             return UPNP_E_FINISH;
         }
         break;
     }
     default:
         // Ignore other events for now
+        STATINC(otherEvents);
         LOGDEB("discovery:cluCallBack: unprocessed evt type: [" << 
                LibUPnP::evTypeAsString(et) << "]"  << endl);
         break;
@@ -189,12 +638,147 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
     return UPNP_E_SUCCESS;
 }
 
+// Threads and callbacks waiting for a specific device to appear
+// (getDevByUDN(), getDevByFName(), getDevByUDNAsync()). They are
+// indexed by lookup key, so that an insertion only wakes up the
+// concerned waiters.
+class DevWaiter {
+public:
+    DevWaiter(UPnPDeviceDirectory::DevFoundCB _cb = 
+              UPnPDeviceDirectory::DevFoundCB(), time_t _deadline = 0)
+        : cb(_cb), deadline(_deadline), done(false) {
+        pthread_cond_init(&cond, 0);
+    }
+    ~DevWaiter() {
+        pthread_cond_destroy(&cond);
+    }
+    // Asynchronous waiter: completion function and timeout.
+    UPnPDeviceDirectory::DevFoundCB cb;
+    time_t deadline;
+    // Synchronous waiter: the thread sleeps on cond
+    pthread_cond_t cond;
+    bool done;
+    DDescH dev;
+};
+typedef unordered_multimap<string, DevWaiter*> WaiterMap;
+static WaiterMap o_udnWaiters;
+static WaiterMap o_fnameWaiters;
+static PTMutexInit o_waiters_mutex;
+
+// Call with the waiters locked
+static void removeWaiter(WaiterMap& wmap, const string& key, DevWaiter *w)
+{
+    auto range = wmap.equal_range(key);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second == w) {
+            wmap.erase(it);
+            return;
+        }
+    }
+}
+
+// Call with the waiters locked. The synchronous waiters are signalled,
+// the asynchronous ones are returned for the caller to run them
+// after unlocking.
+static void wakeWaiters1(WaiterMap& wmap, const string& key, DDescH dev,
+                         vector<DevWaiter*>& async)
+{
+    auto range = wmap.equal_range(key);
+    for (auto it = range.first; it != range.second;) {
+        DevWaiter *w = it->second;
+        it = wmap.erase(it);
+        w->dev = dev;
+        w->done = true;
+        if (w->cb) {
+            async.push_back(w);
+        } else {
+            pthread_cond_signal(&w->cond);
+        }
+    }
+}
+
+// Called from the callback thread after a device was inserted in the pool
+static void wakeWaiters(DDescH dev)
+{
+    vector<DevWaiter*> async;
+    {
+        PTMutexLocker lock(o_waiters_mutex);
+        wakeWaiters1(o_udnWaiters, dev->UDN, dev, async);
+        wakeWaiters1(o_fnameWaiters, dev->friendlyName, dev, async);
+    }
+    for (auto it = async.begin(); it != async.end(); it++) {
+        (*it)->cb(dev);
+        delete *it;
+    }
+}
+
+// Called by the expiry thread: get rid of the asynchronous waiters
+// which timed out, and return the next deadline (0 if none).
+static time_t expireWaiters(time_t now, vector<DevWaiter*>& timedout)
+{
+    PTMutexLocker lock(o_waiters_mutex);
+    time_t next = 0;
+    for (auto it = o_udnWaiters.begin(); it != o_udnWaiters.end();) {
+        DevWaiter *w = it->second;
+        if (!w->cb) {
+            it++;
+        } else if (w->deadline <= now) {
+            timedout.push_back(w);
+            it = o_udnWaiters.erase(it);
+        } else {
+            if (next == 0 || w->deadline < next)
+                next = w->deadline;
+            it++;
+        }
+    }
+    return next;
+}
+
 // Our client can set up functions to be called when we process a new device.
 // This is used during startup, when the pool is not yet complete, to enable
 // finding and listing devices as soon as they appear.
 static vector<UPnPDeviceDirectory::Visitor> o_callbacks;
 static PTMutexInit o_callbacks_mutex;
 
+// The client callbacks are run by a separate thread, so that a slow
+// one does not hold up the discovery processing.
+class CallbackTask {
+public:
+    CallbackTask(bool _alive, DDescH _dev) : alive(_alive), dev(_dev) {}
+    // Device appeared (else it went away)
+    bool alive;
+    DDescH dev;
+};
+static WorkQueue<CallbackTask*> o_callbackQueue("DiscoCallbacks");
+static vector<UPnPDeviceDirectory::Visitor> o_lostcallbacks;
+
+static void *callbackWorker(void *)
+{
+    for (;;) {
+        CallbackTask *tsk = 0;
+        if (!o_callbackQueue.take(&tsk)) {
+            o_callbackQueue.workerExit();
+            return (void*)1;
+        }
+        if (tsk->alive)
+            wakeWaiters(tsk->dev);
+        PTMutexLocker lock(o_callbacks_mutex);
+        vector<UPnPDeviceDirectory::Visitor>& cbs = tsk->alive ? 
+            o_callbacks : o_lostcallbacks;
+        for (auto cbp = cbs.begin(); cbp != cbs.end(); cbp++) {
+            (*cbp)(*tsk->dev, UPnPServiceDesc());
+        }
+        delete tsk;
+    }
+}
+
+static void queueCallbacks(bool alive, DDescH dev)
+{
+    CallbackTask *tsk = new CallbackTask(alive, dev);
+    if (!o_callbackQueue.put(tsk))
+        delete tsk;
+}
+
 unsigned int UPnPDeviceDirectory::addCallback(UPnPDeviceDirectory::Visitor v)
 {
     PTMutexLocker lock(o_callbacks_mutex);
@@ -210,110 +794,747 @@ void UPnPDeviceDirectory::delCallback(unsigned int idx)
     o_callbacks.erase(o_callbacks.begin() + idx);
 }
 
+// Targeted searches in progress (searchFor()). The discovery thread
+// hands them the matching devices as they are inserted in the pool.
+class ActiveSearch {
+public:
+    ActiveSearch(const string& tg) : target(tg) {}
+    string target;
+    // Matches not yet seen by the searching thread
+    vector<DDescH> pending;
+};
+static set<ActiveSearch*> o_searches;
+static PTMutexInit o_searches_mutex;
+static pthread_cond_t o_searches_cond = PTHREAD_COND_INITIALIZER;
+
+// Functions to be called when a device goes away.
+
+unsigned int UPnPDeviceDirectory::addLostCallback(
+    UPnPDeviceDirectory::Visitor v)
+{
+    PTMutexLocker lock(o_callbacks_mutex);
+    o_lostcallbacks.push_back(v);
+    return o_lostcallbacks.size() - 1;
+}
+
+void UPnPDeviceDirectory::delLostCallback(unsigned int idx)
+{
+    PTMutexLocker lock(o_callbacks_mutex);
+    if (idx >= o_lostcallbacks.size())
+        return;
+    o_lostcallbacks.erase(o_lostcallbacks.begin() + idx);
+}
+
+static void runLostCallbacks(const vector<DDescH>& lost)
+{
+    for (auto it = lost.begin(); it != lost.end(); it++) {
+        queueCallbacks(false, *it);
+    }
+}
+
+// Check if a device matches an SSDP search target: ssdp:all,
+// upnp:rootdevice, UDN, or device or service type (version ignored).
+static bool matchTarget(const string& target, const UPnPDeviceDesc& dev)
+{
+    if (!target.compare("ssdp:all") || !target.compare("upnp:rootdevice"))
+        return true;
+    if (!target.compare(0, 5, "uuid:"))
+        return !target.compare(dev.UDN);
+    string tp = typeNoVersion(target);
+    if (dev.hasDeviceType(tp))
+        return true;
+    for (auto it = dev.services.begin(); it != dev.services.end(); it++) {
+        if (!tp.compare(it->serviceType.base().str()))
+            return true;
+    }
+    return false;
+}
+
+// Called by the discovery thread when a device is inserted in the pool
+static void notifySearches(DDescH dev)
+{
+    PTMutexLocker lock(o_searches_mutex);
+    bool found = false;
+    for (auto it = o_searches.begin(); it != o_searches.end(); it++) {
+        if (matchTarget((*it)->target, *dev)) {
+            (*it)->pending.push_back(dev);
+            found = true;
+        }
+    }
+    if (found)
+        pthread_cond_broadcast(&o_searches_cond);
+}
+
 // Descriptor kept in the device pool for each device found on the network.
+// The description itself is shared with the published snapshots and
+// never modified.
 class DeviceDescriptor {
 public:
-    DeviceDescriptor(const string& url, const string& description,
-                     time_t last, int exp)
-        : device(url, description), last_seen(last), expires(exp+20)
+    DeviceDescriptor(DDescH desc, time_t last, int exp)
+        : device(desc), last_seen(last), expires(exp+20), verified(true),
+          scheduled(0)
         {}
     DeviceDescriptor()
+        : last_seen(0), expires(0), verified(false), scheduled(0)
         {}
-    UPnPDeviceDesc device;
+    DDescH device;
     time_t last_seen;
     int expires; // seconds valid
+    // False for entries reloaded from the pool file, until the device
+    // shows up on the network.
+    bool verified;
+    // Deadline of our current entry in the expiry heap. Heap entries
+    // with another deadline are stale and ignored.
+    time_t scheduled;
+
+    time_t deadline() const {return last_seen + expires;}
+};
+
+// Immutable view of the device set, used by the readers (traverse,
+// lookups). A new one is published after each change, readers just
+// grab a reference to the current one and need no locking.
+class PoolSnapshot {
+public:
+    typedef unordered_map<string, set<string> > Index;
+    // Devices by deviceId (==UDN)
+    map<string, DDescH> devices;
+    // Secondary indexes. The values are devices keys. The types are
+    // stored without the version part.
+    Index byFName;
+    Index byDevType;
+    Index byServType;
+
+    void index(const string& id, const UPnPDeviceDesc& dev) {
+        byFName[dev.friendlyName].insert(id);
+        byDevType[dev.deviceType.base().str()].insert(id);
+        for (auto tit = dev.embeddedTypes.begin(); 
+             tit != dev.embeddedTypes.end(); tit++) {
+            byDevType[tit->base().str()].insert(id);
+        }
+        for (auto sit = dev.services.begin(); sit != dev.services.end(); sit++){
+            byServType[sit->serviceType.base().str()].insert(id);
+        }
+    }
+    void unindex(const string& id, const UPnPDeviceDesc& dev) {
+        unindex1(byFName, dev.friendlyName, id);
+        unindex1(byDevType, dev.deviceType.base().str(), id);
+        for (auto tit = dev.embeddedTypes.begin(); 
+             tit != dev.embeddedTypes.end(); tit++) {
+            unindex1(byDevType, tit->base().str(), id);
+        }
+        for (auto sit = dev.services.begin(); sit != dev.services.end(); sit++){
+            unindex1(byServType, sit->serviceType.base().str(), id);
+        }
+    }
+private:
+    static void unindex1(Index& idx, const string& key, const string& id) {
+        auto it = idx.find(key);
+        if (it != idx.end()) {
+            it->second.erase(id);
+            if (it->second.empty())
+                idx.erase(it);
+        }
+    }
 };
 
 // A DevicePool holds the characteristics of the devices
 // currently on the network.
 // The map is referenced by deviceId (==UDN)
 // The class is instanciated as a static (unenforced) singleton.
+//
+// m_devices holds the bookkeeping data (timestamps), and is only
+// accessed with m_mutex held. Changes to the device set are applied to
+// a private copy of the current snapshot, which publish() makes
+// visible to the readers.
+//
+// The expiry deadlines are kept in a min-heap, processed by the
+// expiry thread. Refreshes do not update the heap unless they make
+// the deadline earlier: when an entry comes up, the actual deadline
+// is checked and the device is rescheduled if needed.
 class DevicePool {
 public:
+    DevicePool() 
+        : m_dirty(false), m_loaded(false), m_stopexpiry(false),
+          m_snap(std::make_shared<PoolSnapshot>()) {
+        pthread_cond_init(&m_expirycond, 0);
+    }
+    typedef map<string, DeviceDescriptor>::iterator DevPoolIt;
+
+    // Insert or replace device. Call with the pool locked.
+    void insert(const string& id, const DeviceDescriptor& d) {
+        PoolSnapshot& next = nextSnapshot();
+        DevPoolIt it = m_devices.find(id);
+        if (it != m_devices.end()) {
+            next.unindex(id, *it->second.device);
+            time_t scheduled = it->second.scheduled;
+            it->second = d;
+            it->second.scheduled = scheduled;
+        } else {
+            it = m_devices.insert(pair<string, DeviceDescriptor>(id, d)).first;
+        }
+        next.devices[id] = d.device;
+        next.index(id, *d.device);
+        schedule(it);
+        m_dirty = true;
+    }
+    // Device seen again, with an unchanged description. Call with the
+    // pool locked.
+    void refresh(DevPoolIt it, int exp) {
+        it->second.last_seen = time(0);
+        it->second.expires = exp + 20;
+        it->second.verified = true;
+        schedule(it);
+    }
+    // Make sure that the device has an expiry heap entry not later
+    // than its deadline. Call with the pool locked.
+    void schedule(DevPoolIt it) {
+        time_t deadline = it->second.deadline();
+        if (it->second.scheduled != 0 && it->second.scheduled <= deadline)
+            return;
+        bool wakeup = m_deadlines.empty() || deadline < m_deadlines.top().first;
+        m_deadlines.push(pair<time_t, string>(deadline, it->first));
+        it->second.scheduled = deadline;
+        if (wakeup)
+            pthread_cond_signal(&m_expirycond);
+    }
+    // Remove the devices which were not seen before their deadline,
+    // and return their descriptions. Call with the pool locked.
+    void expire(time_t now, vector<DDescH>& lost) {
+        while (!m_deadlines.empty() && m_deadlines.top().first < now) {
+            pair<time_t, string> entry = m_deadlines.top();
+            m_deadlines.pop();
+            DevPoolIt it = m_devices.find(entry.second);
+            if (it == m_devices.end() || it->second.scheduled != entry.first)
+                continue;
+            if (it->second.deadline() < now) {
+                LOGDEB1("discovery: expiring " << it->first << endl);
+                lost.push_back(it->second.device);
+                erase(it);
+            } else {
+                it->second.scheduled = 0;
+                schedule(it);
+            }
+        }
+    }
+    // Next time the expiry thread should look at the heap. 
+    time_t nextExpiry(time_t now) {
+        return m_deadlines.empty() ? now + 3600 : m_deadlines.top().first + 1;
+    }
+    // Call with the pool locked.
+    void erase(DevPoolIt it) {
+        PoolSnapshot& next = nextSnapshot();
+        next.unindex(it->first, *it->second.device);
+        next.devices.erase(it->first);
+        m_devices.erase(it);
+        m_dirty = true;
+    }
+    // Make the changes visible to readers. Call with the pool locked.
+    void publish() {
+        if (m_next) {
+            std::shared_ptr<const PoolSnapshot> snap(m_next);
+            std::atomic_store(&m_snap, snap);
+            m_next.reset();
+        }
+    }
+    // Get the current snapshot. No locking needed.
+    std::shared_ptr<const PoolSnapshot> snapshot() {
+        return std::atomic_load(&m_snap);
+    }
+
     PTMutexInit m_mutex;
     map<string, DeviceDescriptor> m_devices;
+    // The device set changed since we last saved it
+    bool m_dirty;
+    // Pool was initialized from the saved file
+    bool m_loaded;
+    // Expiry thread control
+    pthread_cond_t m_expirycond;
+    bool m_stopexpiry;
+
+private:
+    PoolSnapshot& nextSnapshot() {
+        if (!m_next)
+            m_next = std::make_shared<PoolSnapshot>(*snapshot());
+        return *m_next;
+    }
+    std::shared_ptr<const PoolSnapshot> m_snap;
+    // Pending changes, not yet published.
+    std::shared_ptr<PoolSnapshot> m_next;
+    typedef pair<time_t, string> Deadline;
+    priority_queue<Deadline, vector<Deadline>, greater<Deadline> > m_deadlines;
 };
 static DevicePool o_pool;
-typedef map<string, DeviceDescriptor>::iterator DevPoolIt;
+typedef DevicePool::DevPoolIt DevPoolIt;
+static pthread_t o_expirythread;
+static bool o_expirythread_ok;
+
+// Background search scheduling, run by the expiry thread. The
+// searches are repeated at an interval which doubles each time
+// nothing changed since the previous one, up to a maximum. Devices
+// appearing unexpectedly reset the interval, and devices going away
+// (byebye or expiry) also trigger a search after a short delay, as
+// this may be a sign of network trouble. All the methods are called
+// with the pool locked.
+static int o_searchMinInterval = 10;
+static int o_searchMaxInterval = 900;
+// Delay for a search after a loss, to batch a burst of them.
+static const int o_searchLossDelay = 2;
+
+class SearchScheduler {
+public:
+    SearchScheduler() 
+        : interval(o_searchMinInterval), next(0), last(0), windowend(0),
+          churn(0) {}
+    // A device appeared or changed. Ignore the answers to our own search.
+    void changed(time_t now) {
+        if (now > windowend) {
+            churn++;
+            interval = o_searchMinInterval;
+        }
+    }
+    // A device went away.
+    void lost(time_t now) {
+        churn++;
+        interval = o_searchMinInterval;
+        schedule(max(now + o_searchLossDelay, last + o_searchMinInterval));
+    }
+    // Network configuration change: search at once.
+    void reset(time_t now) {
+        churn++;
+        interval = o_searchMinInterval;
+        schedule(now);
+    }
+    // Called after a search with window mx.
+    void searched(time_t now, int mx) {
+        if (churn == 0)
+            interval *= 2;
+        interval = max(o_searchMinInterval, 
+                       min(interval, o_searchMaxInterval));
+        churn = 0;
+        last = now;
+        windowend = now + mx + 1;
+        next = now + interval;
+    }
+    bool due(time_t now) {
+        return next && now >= next;
+    }
+    time_t nextSearch() {
+        return next;
+    }
+private:
+    void schedule(time_t t) {
+        if (next == 0 || t < next)
+            next = t;
+    }
+    int interval;
+    time_t next;
+    time_t last;
+    time_t windowend;
+    int churn;
+};
+static SearchScheduler o_searchsched;
+
+// Search window to use for a background search. Many devices
+// answering at once can overflow the network or our socket buffers,
+// so spread the answers over a longer interval on big networks (the
+// standard allows up to 5 S).
+static int searchMX(int base, size_t ndevs)
+{
+    int mx = 1 + int(ndevs / 32);
+    if (mx > 5)
+        mx = 5;
+    return max(base, mx);
+}
+
+// Persistent storage for the pool, allowing a restarting process
+// to use the devices immediately instead of waiting for the search
+// window. The format is a header line, then one record per device,
+// made of length-prefixed strings and numbers, and ending with a
+// newline. The strings may contain newlines, so the records are not
+// lines.
+static string o_poolfile;
+// Serializes the pool writers, so that an older copy of the pool
+// can't replace a newer one. Taken before the pool lock.
+static PTMutexInit o_savemutex;
+static const char *poolfile_magic = "upnpp-devpool 2";
+// Grace period for unverified devices: if they did not show up by
+// then, they are probably gone.
+static const int unverified_grace = 30;
+
+static void putField(ostream& out, const string& s)
+{
+    out << s.size() << ':' << s;
+}
+
+static bool getField(istream& in, string& s)
+{
+    string::size_type len;
+    if (!(in >> len) || in.get() != ':' || len > 100000)
+        return false;
+    s.resize(len);
+    if (len && !in.read(&s[0], len))
+        return false;
+    return true;
+}
+
+static bool getField(istream& in, IString& s)
+{
+    string value;
+    if (!getField(in, value))
+        return false;
+    s = value;
+    return true;
+}
+
+// Save the pool if it changed. Called with the pool unlocked: the
+// entries are copied under the lock, and the file is written after
+// releasing it, so that the discovery threads do not wait on disk
+// I/O.
+static void savePool()
+{
+    if (o_poolfile.empty())
+        return;
+    PTMutexLocker savelock(o_savemutex);
+    vector<pair<string, DeviceDescriptor> > entries;
+    {
+        PTMutexLocker lock(o_pool.m_mutex);
+        if (!o_pool.m_dirty)
+            return;
+        entries.assign(o_pool.m_devices.begin(), o_pool.m_devices.end());
+        o_pool.m_dirty = false;
+    }
+
+    string tmpname = o_poolfile + ".tmp";
+    ofstream out(tmpname.c_str(), ios::out | ios::trunc);
+    if (out.is_open()) {
+        out << poolfile_magic << "\n";
+        for (auto it = entries.begin(); it != entries.end(); it++) {
+            const UPnPDeviceDesc& dev = *it->second.device;
+            putField(out, it->first);
+            out << ' ' << it->second.last_seen << ' ' << 
+                it->second.expires << ' ';
+            putField(out, dev.deviceType);
+            putField(out, dev.friendlyName);
+            putField(out, dev.UDN);
+            putField(out, dev.URLBase);
+            putField(out, dev.manufacturer);
+            putField(out, dev.modelName);
+            out << ' ' << dev.services.size() << ' ';
+            for (auto sit = dev.services.begin(); 
+                 sit != dev.services.end(); sit++) {
+                putField(out, sit->serviceType);
+                putField(out, sit->serviceId);
+                putField(out, sit->SCPDURL);
+                putField(out, sit->controlURL);
+                putField(out, sit->eventSubURL);
+            }
+            out << ' ' << dev.embeddedTypes.size() << ' ';
+            for (auto tit = dev.embeddedTypes.begin(); 
+                 tit != dev.embeddedTypes.end(); tit++) {
+                putField(out, *tit);
+            }
+            out << "\n";
+        }
+        out.close();
+    }
+    if (!out || rename(tmpname.c_str(), o_poolfile.c_str()) != 0) {
+        LOGERR("discovery: error saving device pool to " << o_poolfile << 
+               endl);
+        unlink(tmpname.c_str());
+        // Try again next time
+        PTMutexLocker lock(o_pool.m_mutex);
+        o_pool.m_dirty = true;
+    }
+}
+
+// Load the saved pool. The entries are marked unverified and will
+// expire after the search window and a grace period, if the device
+// does not show up by then.
+static void loadPool(int searchwindow)
+{
+    if (o_poolfile.empty())
+        return;
+    ifstream in(o_poolfile.c_str());
+    if (!in.is_open())
+        return;
+    string line;
+    if (!getline(in, line) || line.compare(poolfile_magic)) {
+        LOGERR("discovery: bad pool file " << o_poolfile << endl);
+        return;
+    }
+    time_t now = time(0);
+    PTMutexLocker lock(o_pool.m_mutex);
+    // The records are length-prefixed, and can't be resynchronized
+    // after an error: stop at the first bad one.
+    istream& str(in);
+    while (str.peek() != EOF) {
+        string id;
+        DeviceDescriptor d;
+        std::shared_ptr<UPnPDeviceDesc> devp = std::make_shared<UPnPDeviceDesc>();
+        UPnPDeviceDesc& dev = *devp;
+        size_t nserv;
+        if (!getField(str, id) || !(str >> d.last_seen >> d.expires) ||
+            str.get() != ' ' ||
+            !getField(str, dev.deviceType) || 
+            !getField(str, dev.friendlyName) || 
+            !getField(str, dev.UDN) || 
+            !getField(str, dev.URLBase) ||
+            !getField(str, dev.manufacturer) ||
+            !getField(str, dev.modelName) || !(str >> nserv) ||
+            str.get() != ' ') {
+            LOGERR("discovery: bad device record in " << o_poolfile << endl);
+            break;
+        }
+        bool ok = true;
+        for (size_t i = 0; i < nserv; i++) {
+            UPnPServiceDesc serv;
+            if (!getField(str, serv.serviceType) ||
+                !getField(str, serv.serviceId) ||
+                !getField(str, serv.SCPDURL) ||
+                !getField(str, serv.controlURL) ||
+                !getField(str, serv.eventSubURL)) {
+                ok = false;
+                break;
+            }
+            dev.services.push_back(serv);
+        }
+        size_t ntypes = 0;
+        if (ok && (!(str >> ntypes) || str.get() != ' '))
+            ok = false;
+        for (size_t i = 0; ok && i < ntypes; i++) {
+            IString tp;
+            if (!getField(str, tp)) {
+                ok = false;
+                break;
+            }
+            dev.embeddedTypes.push_back(tp);
+        }
+        if (!ok || str.get() != '\n') {
+            LOGERR("discovery: bad service data in " << o_poolfile << endl);
+            break;
+        }
+        dev.ok = true;
+        d.device = devp;
+        d.verified = false;
+        d.last_seen = now;
+        d.expires = searchwindow + unverified_grace;
+        o_pool.insert(id, d);
+    }
+    o_pool.publish();
+    o_pool.m_dirty = false;
+    o_pool.m_loaded = !o_pool.m_devices.empty();
+    LOGDEB("discovery: loaded " << o_pool.m_devices.size() << 
+           " devices from " << o_poolfile << endl);
+}
+
+static bool refreshInPool(const string& deviceId, int expires)
+{
+    PTMutexLocker lock(o_pool.m_mutex);
+    DevPoolIt it = o_pool.m_devices.find(deviceId);
+    if (it == o_pool.m_devices.end())
+        return false;
+    o_pool.refresh(it, expires);
+    return true;
+}
+
+static bool inPool(const string& deviceId)
+{
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    return snap->devices.find(deviceId) != snap->devices.end();
+}
 
 // Worker routine for the discovery queue. Get messages about devices
 // appearing and disappearing, and update the directory pool
 // accordingly.
-void *UPnPDeviceDirectory::discoExplorer(void *)
+void *UPnPDeviceDirectory::discoExplorer(void *arg)
 {
+    WorkQueue<DiscoveredTask*> *queue = (WorkQueue<DiscoveredTask*> *)arg;
     for (;;) {
         DiscoveredTask *tsk = 0;
         size_t qsz;
-        if (!discoveredQueue.take(&tsk, &qsz)) {
-            discoveredQueue.workerExit();
+        if (!queue->take(&tsk, &qsz)) {
+            queue->workerExit();
             return (void*)1;
         }
         LOGDEB1("discoExplorer: got task: alive " << tsk->alive << " deviceId ["
                 << tsk->deviceId << " URL [" << tsk->url << "]" << endl);
+        stathist(&DiscoveryStats::queueWaitUs, usecsnow() - tsk->queued);
 
         if (!tsk->alive) {
             // Device signals it is going off.
+            vector<DDescH> lost;
+            {
+                PTMutexLocker lock(o_pool.m_mutex);
+                DevPoolIt it = o_pool.m_devices.find(tsk->deviceId);
+                if (it != o_pool.m_devices.end()) {
+                    lost.push_back(it->second.device);
+                    o_pool.erase(it);
+                    o_pool.publish();
+                    STATINC(byebyeRemoved);
+                    o_searchsched.lost(time(0));
+                    pthread_cond_signal(&o_pool.m_expirycond);
+                    //LOGDEB("discoExplorer: delete " << 
+                    // tsk->deviceId.c_str() << endl);
+                }
+            }
+            runLostCallbacks(lost);
+        } else if (tsk->refresh) {
+            // Known device re-announcing itself with an unchanged
+            // description.
             PTMutexLocker lock(o_pool.m_mutex);
             DevPoolIt it = o_pool.m_devices.find(tsk->deviceId);
             if (it != o_pool.m_devices.end()) {
-                o_pool.m_devices.erase(it);
-                //LOGDEB("discoExplorer: delete " << tsk->deviceId.c_str() << 
-                // endl);
+                o_pool.refresh(it, tsk->expires);
             }
         } else {
-            // Update or insert the device
-            DeviceDescriptor d(tsk->url, tsk->description, time(0), tsk->expires);
-            if (!d.device.ok) {
-                LOGERR("discoExplorer: description parse failed for " << 
-                       tsk->deviceId << endl);
+            if (!o_interest.empty() && !isInteresting(*tsk->parsed)) {
+                LOGDEB1("discoExplorer: not interested in " << 
+                        tsk->deviceId << endl);
                 delete tsk;
                 continue;
             }
+
+            // Update or insert the device
+            DeviceDescriptor d(tsk->parsed, time(0), tsk->expires);
             LOGDEB1("discoExplorer: found id [" << tsk->deviceId  << "]" 
-                    << " name " << d.device.friendlyName 
-                    << " devtype " << d.device.deviceType << endl);
+                    << " name " << d.device->friendlyName 
+                    << " devtype " << d.device->deviceType << endl);
+            bool changed = true;
             {
                 PTMutexLocker lock(o_pool.m_mutex);
-                //LOGDEB1("discoExplorer: inserting device id "<< tsk->deviceId
-                // <<  " description: " << endl << d.device.dump() << endl);
-                o_pool.m_devices[tsk->deviceId] = d;
-            }
-            {
-                PTMutexLocker lock(o_callbacks_mutex);
-                for (auto cbp = o_callbacks.begin(); 
-                     cbp != o_callbacks.end(); cbp++) {
-                    (*cbp)(d.device, UPnPServiceDesc());
+                DevPoolIt it = o_pool.m_devices.find(tsk->deviceId);
+                if (it != o_pool.m_devices.end() && 
+                    it->second.device == tsk->parsed) {
+                    // Same description object from the cache: the
+                    // document did not change, this is just a refresh.
+                    o_pool.refresh(it, tsk->expires);
+                    changed = false;
+                } else {
+                    //LOGDEB1("discoExplorer: inserting device id "<< 
+                    // tsk->deviceId <<  " description: " << endl << 
+                    // d.device.dump() << endl);
+                    o_pool.insert(tsk->deviceId, d);
+                    o_pool.publish();
+                    STATINC(devicesAdded);
+                    o_searchsched.changed(time(0));
                 }
             }
+            // Only tell the clients about new or changed devices
+            if (changed) {
+                notifySearches(d.device);
+                queueCallbacks(true, d.device);
+            }
         }
         delete tsk;
+
+        // Save the pool if it changed, once a burst of messages has
+        // been processed.
+        if (qsz <= 1)
+            savePool();
     }
 }
 
-// Look at the devices and get rid of those which have not been seen
-// for too long. We do this when listing the top directory
-void UPnPDeviceDirectory::expireDevices()
+// Send the M-SEARCH requests for our targets.
+static bool sendSearch(int mx, string& reason)
 {
-    LOGDEB1("discovery: expireDevices:" << endl);
-    PTMutexLocker lock(o_pool.m_mutex);
-    time_t now = time(0);
-    bool didsomething = false;
-
-    for (DevPoolIt it = o_pool.m_devices.begin();
-         it != o_pool.m_devices.end();) {
-        LOGDEB1("Dev in pool: type: " << it->second.device.deviceType <<
-                " friendlyName " << it->second.device.friendlyName << endl);
-        if (now - it->second.last_seen > it->second.expires) {
-            //LOGDEB("expireDevices: deleting " <<  it->first.c_str() << " " << 
-            //   it->second.device.friendlyName.c_str() << endl);
-            o_pool.m_devices.erase(it++);
-            didsomething = true;
-        } else {
-            it++;
+    LibUPnP *lib = LibUPnP::getLibUPnP();
+    if (lib == 0) {
+        reason = "Can't get lib";
+        return false;
+    }
+
+    LOGDEB1("discovery: sendSearch: calling upnpsearchasync, mx " << mx <<
+            endl);
+    // With an interest filter, only ask for the devices we want. The
+    // answers are typed, so they get through the filter.
+    vector<string> targets(o_interestTypes);
+    if (targets.empty()) {
+        //targets.push_back("ssdp:all");
+        targets.push_back("upnp:rootdevice");
+    }
+    for (auto it = targets.begin(); it != targets.end(); it++) {
+        int code1 = UpnpSearchAsync(lib->getclh(), mx, it->c_str(), lib);
+        if (code1 != UPNP_E_SUCCESS) {
+            reason = LibUPnP::errAsString("UpnpSearchAsync", code1);
+            LOGERR("discovery: sendSearch: UpnpSearchAsync failed: " <<
+                   reason << endl);
         }
     }
-    if (didsomething)
-        search();
+    return true;
+}
+
+// Expiry thread: get rid of the devices which have not been seen for
+// too long, as soon as their deadline is past. This also times out
+// the asynchronous device lookups, runs the background searches, and
+// purges the description cache.
+void *UPnPDeviceDirectory::expiryWorker(void *)
+{
+    time_t nextpurge = time(0) + o_purgeInterval;
+    for (;;) {
+        vector<DDescH> lost;
+        vector<DevWaiter*> timedout;
+        int mx = 0;
+        bool purge = false;
+        {
+            PTMutexLocker lock(o_pool.m_mutex);
+            if (o_pool.m_stopexpiry)
+                break;
+            time_t now = time(0);
+            if (now >= nextpurge) {
+                purge = true;
+                nextpurge = now + o_purgeInterval;
+            }
+            o_pool.expire(now, lost);
+            time_t nextwaiter = expireWaiters(now, timedout);
+            if (!lost.empty()) {
+                // Devices going away may be a sign of network
+                // trouble, look again soon.
+                o_searchsched.lost(now);
+            }
+            if (theDevDir && o_searchsched.due(now)) {
+                mx = searchMX(theDevDir->m_searchTimeout, 
+                              o_pool.m_devices.size());
+                o_searchsched.searched(now, mx);
+            }
+            if (lost.empty() && timedout.empty() && mx == 0 && !purge) {
+                struct timespec wkuptime;
+                wkuptime.tv_sec = min(o_pool.nextExpiry(now), nextpurge);
+                if (nextwaiter && nextwaiter < wkuptime.tv_sec)
+                    wkuptime.tv_sec = nextwaiter;
+                time_t nextsearch = o_searchsched.nextSearch();
+                if (nextsearch && nextsearch < wkuptime.tv_sec)
+                    wkuptime.tv_sec = nextsearch;
+                wkuptime.tv_nsec = 0;
+                pthread_cond_timedwait(&o_pool.m_expirycond, lock.getMutex(),
+                                       &wkuptime);
+                continue;
+            }
+            if (!lost.empty()) {
+                {PTMutexLocker statlock(o_stats_mutex);
+                    o_stats.expired += lost.size();
+                }
+                o_pool.publish();
+            }
+        }
+        if (!lost.empty())
+            savePool();
+        if (purge)
+            purgeDescCache();
+        for (auto it = timedout.begin(); it != timedout.end(); it++) {
+            (*it)->cb(DDescH());
+            delete *it;
+        }
+        if (mx) {
+            LOGDEB("discovery: background search, mx " << mx << endl);
+            string reason;
+            sendSearch(mx, reason);
+        }
+        if (!lost.empty()) {
+            LOGDEB("discovery: " << lost.size() << " devices expired" << endl);
+            runLostCallbacks(lost);
+        }
+    }
+    return 0;
 }
 
 // m_searchTimeout is the UPnP device search timeout, which should
@@ -324,10 +1545,31 @@ void UPnPDeviceDirectory::expireDevices()
 UPnPDeviceDirectory::UPnPDeviceDirectory(time_t search_window)
     : m_ok(false), m_searchTimeout(search_window), m_lastSearch(0)
 {
-    addCallback(std::bind(&UPnPDeviceDirectory::deviceFound, this, _1, _2));
+    loadPool(m_searchTimeout);
 
-    if (!discoveredQueue.start(1, discoExplorer, 0)) {
-        m_reason = "Discover work queue start failed";
+    if (!o_callbackQueue.start(1, callbackWorker, 0)) {
+        m_reason = "Discover callback queue start failed";
+        return;
+    }
+    for (int i = 0; i < o_discoWorkers; i++) {
+        ostringstream name;
+        name << "DiscoveredQueue" << i;
+        WorkQueue<DiscoveredTask*> *queue = 
+            new WorkQueue<DiscoveredTask*>(name.str());
+        o_discoveredQueues.push_back(queue);
+        if (!queue->start(1, discoExplorer, queue)) {
+            m_reason = "Discover work queue start failed";
+            return;
+        }
+    }
+    if (pthread_create(&o_expirythread, 0, expiryWorker, 0)) {
+        m_reason = "Expiry thread start failed";
+        return;
+    }
+    o_expirythread_ok = true;
+    o_fetcher = new CurlMultiFetcher(o_fetchParallel, o_fetchTimeout);
+    if (o_fetcher == 0 || !o_fetcher->start()) {
+        m_reason = "Description fetcher start failed";
         return;
     }
     sched_yield();
@@ -348,28 +1590,32 @@ UPnPDeviceDirectory::UPnPDeviceDirectory(time_t search_window)
 bool UPnPDeviceDirectory::search()
 {
     LOGDEB1("UPnPDeviceDirectory::search" << endl);
-    if (time(0) - m_lastSearch < 10)
-        return true;
-
-    LibUPnP *lib = LibUPnP::getLibUPnP();
-    if (lib == 0) {
-        m_reason = "Can't get lib";
+    if (!sendSearch(m_searchTimeout, m_reason))
         return false;
-    }
-
-    LOGDEB1("UPnPDeviceDirectory::search: calling upnpsearchasync"<<endl);
-    //const char *cp = "ssdp:all";
-    const char *cp = "upnp:rootdevice";
-    int code1 = UpnpSearchAsync(lib->getclh(), m_searchTimeout, cp, lib);
-    if (code1 != UPNP_E_SUCCESS) {
-        m_reason = LibUPnP::errAsString("UpnpSearchAsync", code1);
-        LOGERR("UPnPDeviceDirectory::search: UpnpSearchAsync failed: " <<
-               m_reason << endl);
-    }
     m_lastSearch = time(0);
+    // The following searches are run by the expiry thread
+    PTMutexLocker lock(o_pool.m_mutex);
+    o_searchsched.searched(m_lastSearch, m_searchTimeout);
+    pthread_cond_signal(&o_pool.m_expirycond);
     return true;
 }
 
+void UPnPDeviceDirectory::networkChanged()
+{
+    PTMutexLocker lock(o_pool.m_mutex);
+    o_searchsched.reset(time(0));
+    pthread_cond_signal(&o_pool.m_expirycond);
+}
+
+void UPnPDeviceDirectory::setSearchIntervals(int minsecs, int maxsecs)
+{
+    PTMutexLocker lock(o_pool.m_mutex);
+    if (minsecs > 0)
+        o_searchMinInterval = minsecs;
+    if (maxsecs >= o_searchMinInterval)
+        o_searchMaxInterval = maxsecs;
+}
+
 UPnPDeviceDirectory *UPnPDeviceDirectory::getTheDir(time_t search_window)
 {
     if (theDevDir == 0)
@@ -381,7 +1627,156 @@ UPnPDeviceDirectory *UPnPDeviceDirectory::getTheDir(time_t search_window)
 
 void UPnPDeviceDirectory::terminate()
 {
-    discoveredQueue.setTerminateAndWait();
+    // The action callbacks may still use the directory
+    Service::terminateAsync();
+    // Stop the fetcher first, it feeds the queue
+    if (o_fetcher)
+        o_fetcher->terminate();
+    for (auto it = o_discoveredQueues.begin(); 
+         it != o_discoveredQueues.end(); it++) {
+        (*it)->setTerminateAndWait();
+    }
+    if (o_expirythread_ok) {
+        {
+            PTMutexLocker lock(o_pool.m_mutex);
+            o_pool.m_stopexpiry = true;
+            pthread_cond_signal(&o_pool.m_expirycond);
+        }
+        pthread_join(o_expirythread, 0);
+        o_expirythread_ok = false;
+    }
+    o_callbackQueue.setTerminateAndWait();
+    vector<DevWaiter*> timedout;
+    expireWaiters(numeric_limits<time_t>::max(), timedout);
+    for (auto it = timedout.begin(); it != timedout.end(); it++) {
+        (*it)->cb(DDescH());
+        delete *it;
+    }
+    savePool();
+}
+
+void UPnPDeviceDirectory::setInterest(const vector<string>& types)
+{
+    o_interest.clear();
+    o_interestTypes.clear();
+    for (auto it = types.begin(); it != types.end(); it++) {
+        if (o_interest.insert(typeNoVersion(*it)).second)
+            o_interestTypes.push_back(*it);
+    }
+}
+
+void UPnPDeviceDirectory::setCoalesceWindow(int secs)
+{
+    o_coalesceWindow = secs;
+}
+
+void UPnPDeviceDirectory::setDiscoveryWorkers(int n)
+{
+    o_discoWorkers = n > 0 ? n : 1;
+}
+
+void UPnPDeviceDirectory::setPersistFile(const string& path)
+{
+    o_poolfile = path;
+}
+
+bool UPnPDeviceDirectory::isVerified(const string& udn)
+{
+    PTMutexLocker lock(o_pool.m_mutex);
+    DevPoolIt it = o_pool.m_devices.find(udn);
+    return it != o_pool.m_devices.end() && it->second.verified;
+}
+
+void UPnPDeviceDirectory::setDescFetchParams(int maxparallel, int timeoutsecs)
+{
+    if (maxparallel > 0)
+        o_fetchParallel = maxparallel;
+    if (timeoutsecs > 0)
+        o_fetchTimeout = timeoutsecs;
+}
+
+// Run the search for searchFor(), with the ActiveSearch registered.
+static bool runSearch(ActiveSearch& srch, 
+                      UPnPDeviceDirectory::MatchCB onmatch,
+                      UPnPDeviceDirectory::DonePred done, int mx)
+{
+    unordered_set<string> seen;
+    // Returns true if the caller is satisfied
+    auto deliver = [&](const vector<DDescH>& devs) -> bool {
+        for (auto it = devs.begin(); it != devs.end(); it++) {
+            if (!seen.insert((*it)->UDN).second)
+                continue;
+            if (onmatch)
+                onmatch(**it);
+            if (done && done())
+                return true;
+        }
+        return false;
+    };
+
+    // Matching devices which we already know about
+    vector<DDescH> devs;
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    for (auto it = snap->devices.begin(); it != snap->devices.end(); it++) {
+        if (matchTarget(srch.target, *it->second))
+            devs.push_back(it->second);
+    }
+    if (deliver(devs))
+        return true;
+
+    LibUPnP *lib = LibUPnP::getLibUPnP();
+    if (lib == 0) {
+        LOGERR("UPnPDeviceDirectory::searchFor: no lib" << endl);
+        return false;
+    }
+    int code = UpnpSearchAsync(lib->getclh(), mx, srch.target.c_str(), lib);
+    if (code != UPNP_E_SUCCESS) {
+        LOGERR("UPnPDeviceDirectory::searchFor: UpnpSearchAsync failed: " <<
+               code << endl);
+        return false;
+    }
+
+    // Answers can come in until mx seconds have elapsed, allow some
+    // more for the description downloads.
+    struct timespec wkuptime;
+    wkuptime.tv_sec = time(0) + mx + 1;
+    wkuptime.tv_nsec = 0;
+    for (;;) {
+        devs.clear();
+        {
+            PTMutexLocker lock(o_searches_mutex);
+            while (srch.pending.empty()) {
+                if (pthread_cond_timedwait(&o_searches_cond, lock.getMutex(),
+                                           &wkuptime) == ETIMEDOUT)
+                    break;
+            }
+            devs.swap(srch.pending);
+        }
+        if (devs.empty())
+            break;
+        if (deliver(devs))
+            return true;
+    }
+    // Timeout. With no completion test, we succeed if anything matched
+    return !done && !seen.empty();
+}
+
+bool UPnPDeviceDirectory::searchFor(const string& target, MatchCB onmatch,
+                                    DonePred done, int mx)
+{
+    if (m_ok == false)
+        return false;
+    if (mx <= 0)
+        mx = m_searchTimeout;
+    ActiveSearch srch(target);
+    {PTMutexLocker lock(o_searches_mutex);
+        o_searches.insert(&srch);
+    }
+    bool ret = runSearch(srch, onmatch, done, mx);
+    {PTMutexLocker lock(o_searches_mutex);
+        o_searches.erase(&srch);
+    }
+    return ret;
 }
 
 time_t UPnPDeviceDirectory::getRemainingDelay()
@@ -397,47 +1792,39 @@ bool UPnPDeviceDirectory::traverse(UPnPDeviceDirectory::Visitor visit)
     //LOGDEB("UPnPDeviceDirectory::traverse" << endl);
     if (m_ok == false)
         return false;
+    // No need to wait for the search results if we got a pool from
+    // the previous run: use it right away.
     int secs = getRemainingDelay();
-    if (secs > 0)
+    if (secs > 0 && !o_pool.m_loaded)
         sleep(secs);
 
-    // Has locking, do it before our own lock
-    expireDevices();
-
-    PTMutexLocker lock(o_pool.m_mutex);
-
-    for (auto it = o_pool.m_devices.begin(); 
-         it != o_pool.m_devices.end(); it++) {
-        for (auto it1 = it->second.device.services.begin();
-             it1 != it->second.device.services.end(); it1++) {
-            if (!visit(it->second.device, *it1))
+    // Visitors may take time (e.g. subscribing to services): walk a
+    // snapshot instead of locking the pool.
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    for (auto it = snap->devices.begin(); it != snap->devices.end(); it++) {
+        for (auto it1 = it->second->services.begin();
+             it1 != it->second->services.end(); it1++) {
+            if (!visit(*it->second, *it1))
                 return false;
         }
     }
     return true;
 }
 
-static PTMutexInit devWaitLock;
-static pthread_cond_t devWaitCond = PTHREAD_COND_INITIALIZER;
-
-bool UPnPDeviceDirectory::deviceFound(const UPnPDeviceDesc&, 
-                                      const UPnPServiceDesc&)
-{
-    PTMutexLocker lock(devWaitLock);
-    pthread_cond_broadcast(&devWaitCond);
-    return true;
-}
-
-bool UPnPDeviceDirectory::getDevBySelector(bool cmp(const UPnPDeviceDesc& ddesc,
-                                                    const string&), 
-                                           const string& value,
-                                           UPnPDeviceDesc& ddesc)
+// Lookup a device in the pool. If not found and a search is active, 
+// register a waiter and sleep until the device shows up or the
+// search window expires.
+static bool getDevBySelector(DDescH lookup(const string&), WaiterMap& wmap,
+                             const string& value, int secs, DDescH& ddesc)
 {
-    // Has locking, do it before our own lock
-    expireDevices();
+    ddesc = lookup(value);
+    if (ddesc)
+        return true;
+    if (secs <= 0)
+        return false;
 
     struct timespec wkuptime;
-    long long nanos = getRemainingDelay() * 1000*1000*1000;
+    long long nanos = secs * 1000LL*1000*1000;
     
     #ifdef __MACH__ // Mac OS X does not have clock_gettime, use clock_get_time
       clock_serv_t cclock;
@@ -452,48 +1839,243 @@ bool UPnPDeviceDirectory::getDevBySelector(bool cmp(const UPnPDeviceDesc& ddesc,
     #endif
 
     UPnPP::timespec_addnanos(&wkuptime, nanos);
-    do {
-        PTMutexLocker lock(devWaitLock);
-        {
-            PTMutexLocker lock(o_pool.m_mutex);
-            for (auto it = o_pool.m_devices.begin(); 
-                 it != o_pool.m_devices.end(); it++) {
-                if (!cmp(it->second.device, value)) {
-                    ddesc = it->second.device;
-                    return true;
-                }
-            }
-        }
 
-        if (nanos > 0) {
-            pthread_cond_timedwait(&devWaitCond, lock.getMutex(), &wkuptime);
-        }
-    } while (getRemainingDelay() > 0);
-    return false;
+    DevWaiter waiter;
+    PTMutexLocker lock(o_waiters_mutex);
+    wmap.insert(pair<string, DevWaiter*>(value, &waiter));
+    // Look again now that we are registered: the insertions are
+    // published before the waiters are woken up, so we can't miss one.
+    ddesc = lookup(value);
+    if (ddesc) {
+        removeWaiter(wmap, value, &waiter);
+        return true;
+    }
+    while (!waiter.done) {
+        if (pthread_cond_timedwait(&waiter.cond, lock.getMutex(), 
+                                   &wkuptime) == ETIMEDOUT)
+            break;
+    }
+    if (!waiter.done) {
+        removeWaiter(wmap, value, &waiter);
+        return false;
+    }
+    ddesc = waiter.dev;
+    return true;
+}
+
+static DDescH lookupFName(const string& fname)
+{
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    auto it = snap->byFName.find(fname);
+    if (it == snap->byFName.end() || it->second.empty())
+        return DDescH();
+    auto dit = snap->devices.find(*it->second.begin());
+    return dit == snap->devices.end() ? DDescH() : dit->second;
 }
 
-static bool cmpFName(const UPnPDeviceDesc& ddesc, const string& fname)
+bool UPnPDeviceDirectory::getDevByFName(const string& fname, DDescH& ddesc)
 {
-    return ddesc.friendlyName.compare(fname);
+    return getDevBySelector(lookupFName, o_fnameWaiters, fname, 
+                            getRemainingDelay(), ddesc);
 }
 
 bool UPnPDeviceDirectory::getDevByFName(const string& fname, 
                                         UPnPDeviceDesc& ddesc)
 {
-    return getDevBySelector(cmpFName, fname, ddesc);
+    DDescH dp;
+    if (!getDevByFName(fname, dp))
+        return false;
+    ddesc = *dp;
+    return true;
+}
+
+static DDescH lookupUDN(const string& value)
+{
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    auto it = snap->devices.find(value);
+    return it == snap->devices.end() ? DDescH() : it->second;
 }
 
-static bool cmpUDN(const UPnPDeviceDesc& ddesc, const string& value)
+bool UPnPDeviceDirectory::getDevByUDN(const string& value, DDescH& ddesc)
 {
-    return ddesc.UDN.compare(value);
+    return getDevBySelector(lookupUDN, o_udnWaiters, value, 
+                            getRemainingDelay(), ddesc);
 }
 
 bool UPnPDeviceDirectory::getDevByUDN(const string& value, 
                                       UPnPDeviceDesc& ddesc)
 {
-    return getDevBySelector(cmpUDN, value, ddesc);
+    DDescH dp;
+    if (!getDevByUDN(value, dp))
+        return false;
+    ddesc = *dp;
+    return true;
+}
+
+void UPnPDeviceDirectory::getDevByUDNAsync(const string& udn, DevFoundCB cb,
+                                           int timeoutsecs)
+{
+    DDescH dev = lookupUDN(udn);
+    if (timeoutsecs < 0)
+        timeoutsecs = getRemainingDelay();
+    if (dev || timeoutsecs <= 0) {
+        cb(dev);
+        return;
+    }
+    {
+        PTMutexLocker lock(o_waiters_mutex);
+        DevWaiter *w = new DevWaiter(cb, time(0) + timeoutsecs);
+        o_udnWaiters.insert(pair<string, DevWaiter*>(udn, w));
+        // Same as getDevBySelector(): look again once registered
+        dev = lookupUDN(udn);
+        if (dev) {
+            removeWaiter(o_udnWaiters, udn, w);
+            delete w;
+        }
+    }
+    if (dev) {
+        cb(dev);
+        return;
+    }
+    // Let the expiry thread know about the new deadline
+    PTMutexLocker lock(o_pool.m_mutex);
+    pthread_cond_signal(&o_pool.m_expirycond);
+}
+
+bool UPnPDeviceDirectory::getDevsByIndex(IndexSel which, const string& key,
+                                         vector<DDescH>& devs)
+{
+    if (m_ok == false)
+        return false;
+    // Same as traverse(): we need the search results unless we got a
+    // saved pool
+    int secs = getRemainingDelay();
+    if (secs > 0 && !o_pool.m_loaded)
+        sleep(secs);
+
+    std::shared_ptr<const PoolSnapshot> snap = o_pool.snapshot();
+    const PoolSnapshot::Index& idx = which == IDX_FNAME ? snap->byFName :
+        which == IDX_DEVTYPE ? snap->byDevType : snap->byServType;
+    auto it = idx.find(which == IDX_FNAME ? key : typeNoVersion(key));
+    if (it == idx.end())
+        return false;
+    size_t sz = devs.size();
+    for (auto uit = it->second.begin(); uit != it->second.end(); uit++) {
+        auto dit = snap->devices.find(*uit);
+        if (dit != snap->devices.end())
+            devs.push_back(dit->second);
+    }
+    return devs.size() > sz;
+}
+
+bool UPnPDeviceDirectory::getDevsByFName(const string& fname,
+                                         vector<DDescH>& devs)
+{
+    return getDevsByIndex(IDX_FNAME, fname, devs);
 }
 
+bool UPnPDeviceDirectory::getDevsByType(const string& devtype,
+                                        vector<DDescH>& devs)
+{
+    return getDevsByIndex(IDX_DEVTYPE, devtype, devs);
+}
+
+bool UPnPDeviceDirectory::getDevsByServiceType(const string& stype,
+                                               vector<DDescH>& devs)
+{
+    return getDevsByIndex(IDX_SERVTYPE, stype, devs);
+}
+
+void DiscoveryStats::Histogram::add(long long v)
+{
+    if (v < 0)
+        v = 0;
+    int i = 0;
+    while (i < NBUCKETS - 1 && (v >> i) != 0)
+        i++;
+    buckets[i]++;
+    count++;
+    sum += v;
+    if (v > max)
+        max = v;
+}
 
+long long DiscoveryStats::Histogram::percentile(int pct) const
+{
+    if (count == 0)
+        return 0;
+    long long target = (count * pct + 99) / 100;
+    long long seen = 0;
+    for (int i = 0; i < NBUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            long long bound = i == 0 ? 0 : (1LL << i) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+void DiscoveryStats::clear()
+{
+    searchResults = alives = byebyes = otherEvents = 0;
+    ignored = coalesced = refreshes = downloadDups = 0;
+    downloads = downloadErrors = notModified = 0;
+    devicesAdded = byebyeRemoved = expired = 0;
+    downloadMs.clear();
+    downloadBytes.clear();
+    parseUs.clear();
+    queueWaitUs.clear();
+    queueDepth = maxQueueDepth = poolSize = 0;
+}
+
+static void dumpHisto(ostream& out, const char *name,
+                      const DiscoveryStats::Histogram& h)
+{
+    out << name << ": count " << h.count << " avg " << h.average() << 
+        " p50 " << h.percentile(50) << " p90 " << h.percentile(90) << 
+        " p99 " << h.percentile(99) << " max " << h.max << endl;
+}
+
+string DiscoveryStats::dump() const
+{
+    ostringstream out;
+    out << "events: search results " << searchResults << " alive " << 
+        alives << " byebye " << byebyes << " other " << otherEvents << endl;
+    out << "messages: ignored " << ignored << " coalesced " << coalesced <<
+        " refreshes " << refreshes << " duplicate downloads " << 
+        downloadDups << endl;
+    out << "downloads: " << downloads << " errors " << downloadErrors <<
+        " not modified " << notModified << endl;
+    out << "pool: size " << poolSize << " added " << devicesAdded << 
+        " byebye " << byebyeRemoved << " expired " << expired << endl;
+    out << "queues: depth " << queueDepth << " max " << maxQueueDepth << endl;
+    dumpHisto(out, "download mS", downloadMs);
+    dumpHisto(out, "download bytes", downloadBytes);
+    dumpHisto(out, "parse uS", parseUs);
+    dumpHisto(out, "queue wait uS", queueWaitUs);
+    return out.str();
+}
+
+DiscoveryStats UPnPDeviceDirectory::getStats()
+{
+    DiscoveryStats stats;
+    {
+        PTMutexLocker lock(o_stats_mutex);
+        stats = o_stats;
+    }
+    for (auto it = o_discoveredQueues.begin(); 
+         it != o_discoveredQueues.end(); it++) {
+        stats.queueDepth += (*it)->qsize();
+    }
+    stats.poolSize = o_pool.snapshot()->devices.size();
+    return stats;
+}
+
+void UPnPDeviceDirectory::resetStats()
+{
+    PTMutexLocker lock(o_stats_mutex);
+    o_stats.clear();
+}
 
 } // namespace UPnPClient
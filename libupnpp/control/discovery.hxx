@@ -20,13 +20,94 @@
 #include <time.h>                       // for time_t
 
 #include <functional>                   // for function
+#include <memory>                       // for shared_ptr
 #include <string>                       // for string
+#include <vector>                       // for vector
 
 namespace UPnPClient { class UPnPDeviceDesc; }
 namespace UPnPClient { class UPnPServiceDesc; }
 
 namespace UPnPClient {
 
+/** Read-only device description, shared with the directory */
+typedef std::shared_ptr<const UPnPDeviceDesc> DDescH;
+
+/** Discovery activity counters, as returned by
+ * UPnPDeviceDirectory::getStats(). All counts are since the start or
+ * the last resetStats(). */
+class DiscoveryStats {
+public:
+    /** Distribution of a measure, in power of 2 buckets: bucket 0 counts
+     * the zero values, bucket i the values in [2^(i-1), 2^i). The last
+     * bucket also gets everything bigger. */
+    class Histogram {
+    public:
+        enum {NBUCKETS = 32};
+        Histogram() {clear();}
+        void clear() {
+            count = sum = max = 0;
+            for (int i = 0; i < NBUCKETS; i++)
+                buckets[i] = 0;
+        }
+        void add(long long v);
+        long long average() const {return count ? sum / count : 0;}
+        /** Approximate value (bucket upper bound) under which a fraction
+         * pct (0-100) of the samples are. */
+        long long percentile(int pct) const;
+
+        long long count;
+        long long sum;
+        long long max;
+        long long buckets[NBUCKETS];
+    };
+
+    DiscoveryStats() {clear();}
+    void clear();
+    /** Print everything, for logging or debugging */
+    std::string dump() const;
+
+    // SSDP messages received, by type
+    long long searchResults;
+    long long alives;
+    long long byebyes;
+    long long otherEvents;
+    // Messages dropped by the interest filter, as redundant (not the
+    // root device message), or because the device description
+    // recently failed to parse
+    long long ignored;
+    // Messages which only refreshed the device lifetime because a
+    // recent one was processed (see setCoalesceWindow())
+    long long coalesced;
+    // Messages for known devices which did not need a download
+    long long refreshes;
+    // Downloads not started because one was already running for the URL
+    long long downloadDups;
+    // Description downloads started, failed, and found unchanged (304)
+    long long downloads;
+    long long downloadErrors;
+    long long notModified;
+    // Pool changes: device inserted or updated, removed by a byebye
+    // message, removed because its lifetime expired
+    long long devicesAdded;
+    long long byebyeRemoved;
+    long long expired;
+
+    // Description download times (mS) and sizes (bytes)
+    Histogram downloadMs;
+    Histogram downloadBytes;
+    // Description parse times (uS)
+    Histogram parseUs;
+    // Time spent by tasks in the discovery queues (uS)
+    Histogram queueWaitUs;
+
+    // Current total depth of the discovery queues, and maximum depth seen
+    // for a single queue.
+    long long queueDepth;
+    long long maxQueueDepth;
+    // Current number of devices in the pool
+    long long poolSize;
+};
+
 /**
  * Manage UPnP discovery and maintain a directory of active devices. Singleton.
  *
@@ -38,17 +119,32 @@ namespace UPnPClient {
  * The search implies a timeout period (the specified interval
  * over which the servers will send replies at random points). Any
  * subsequent traverse() call will block until the timeout
- * is expired. Use getRemainingDelay() to know the current
+ * is expired, except if the pool was reloaded from a file (see
+ * setPersistFile()). Use getRemainingDelay() to know the current
  * remaining delay, and use it to do something else.
  *
  * We need a separate thread to process the messages coming up
  * from libupnp, because some of them will in turn trigger other
  * calls to libupnp, and this must not be done from the libupnp
  * thread context which reported the initial message.
- * So there are three threads in action:
+ * The description documents are downloaded by yet another thread, so
+ * that the libupnp threads are not held up by slow devices.
+ * So there are several threads in action:
  *  - the reporting thread from libupnp.
- *  - the discovery service processing thread, which also runs the callbacks.
+ *  - the description download thread, which runs many downloads in 
+ *    parallel.
+ *  - the discovery service processing threads (see
+ *    setDiscoveryWorkers()). The messages for a given device are 
+ *    always processed by the same thread, in order.
+ *  - the callback thread, which runs the client callbacks.
+ *  - the expiry thread, which removes the devices at the end of their
+ *    advertised lifetime, and repeats the searches in the background
+ *    (see setSearchIntervals()).
  *  - the user thread (typically the main thread), which calls traverse.
+ *
+ * The device set is published as immutable snapshots, so that
+ * traverse() and the lookup calls do not hold up the discovery
+ * thread (or each other) while they run.
  */
 class UPnPDeviceDirectory {
 public:
@@ -62,28 +158,178 @@ public:
     /** Clean up before exit. Do call this.*/
     static void terminate();
 
+    /** Set parameters for downloading the device description
+     * documents. This must be called before the first getTheDir()
+     * to have any effect.
+     *
+     * @param maxparallel maximum number of simultaneous downloads 
+     *   (default 20).
+     * @param timeoutsecs timeout for a single download (default 5).
+     */
+    static void setDescFetchParams(int maxparallel, int timeoutsecs);
+
+    /** Set the number of threads used to process the discovery
+     * messages and parse the device descriptions (default 4). This
+     * must be called before the first getTheDir() to have any effect.
+     */
+    static void setDiscoveryWorkers(int n);
+
+    /** Set the announcement coalescing window. 
+     *
+     * Devices send many messages for each announcement (root device,
+     * embedded devices, services). After one has been processed for a
+     * device, the following ones within this window only refresh
+     * the device lifetime. Default 5 S, 0 disables coalescing.
+     * Independently of this, the device callbacks (addCallback()) are
+     * only called for new devices or changed descriptions.
+     */
+    static void setCoalesceWindow(int secs);
+
+    /** Set the file used to save the device pool across restarts. 
+     *
+     * The pool is saved when it changes, and reloaded by the first 
+     * getTheDir() call. Reloaded devices are usable at once, so that
+     * traverse() does not need to wait for the search window. They are
+     * marked unverified until they show up on the network, and dropped
+     * if they do not. This must be called before the first getTheDir().
+     * The default is not to save the pool.
+     */
+    static void setPersistFile(const std::string& path);
+
+    /** Restrict the directory to the devices of interest.
+     *
+     * The discovery then only downloads the descriptions for root
+     * devices which announce one of these types (as their own type,
+     * an embedded device type or a service type), and searches only
+     * for these. Other devices on the network are ignored. This must
+     * be called before the first getTheDir(). The default is to 
+     * process all devices.
+     *
+     * @param types device and/or service types, e.g.
+     *   "urn:schemas-upnp-org:device:MediaRenderer:1",
+     *   "urn:av-openhome-org:service:Product:1". The version is ignored
+     *   for matching.
+     */
+    static void setInterest(const std::vector<std::string>& types);
+
+    /** Set the bounds for the background search interval.
+     *
+     * After the initial search, the directory searches again at an
+     * interval which starts at minsecs and doubles each time nothing
+     * changed, up to maxsecs. Devices appearing or going away reset it
+     * to minsecs, and a device going away also triggers a search after
+     * a short delay. The defaults are 10 and 900 S.
+     */
+    static void setSearchIntervals(int minsecs, int maxsecs);
+
+    /** Signal a network configuration change (e.g. an interface coming
+     * up). This triggers a search at once and resets the background 
+     * search interval. */
+    static void networkChanged();
+
     typedef std::function<bool (const UPnPDeviceDesc&, 
                                 const UPnPServiceDesc&)> Visitor;
 
-    /** Traverse the directory and call Visitor for each device/service pair */
+    /** Traverse the directory and call Visitor for each device/service pair.
+     * This works on a snapshot of the directory: devices appearing or
+     * disappearing during the traversal are not seen. */
     bool traverse(Visitor);
 
+    typedef std::function<void (const UPnPDeviceDesc&)> MatchCB;
+    typedef std::function<bool ()> DonePred;
+
+    /** Run a targeted search, returning as soon as the caller is
+     * satisfied, instead of waiting for the whole search window.
+     *
+     * Matching devices already in the directory are reported first, 
+     * then the new ones as they answer. Each device is reported once.
+     * The function runs in the calling thread.
+     *
+     * @param target the SSDP search target: a device or service type 
+     *   (e.g. "urn:schemas-upnp-org:device:MediaRenderer:1"), a device
+     *   UDN ("uuid:..."), "upnp:rootdevice" or "ssdp:all".
+     * @param onmatch called for each matching device. May be empty.
+     * @param done completion test, called after each match, e.g. 
+     *   checking that a given UDN or a number of devices were seen. If 
+     *   empty, the search runs for the whole window.
+     * @param mx the search window (MX) in seconds. The default is the 
+     *   directory search window.
+     * @return true if done() returned true, or if done is empty and 
+     *   some device matched.
+     */
+    bool searchFor(const std::string& target, MatchCB onmatch,
+                   DonePred done = DonePred(), int mx = 0);
+
     /** Remaining time until current search complete */
     time_t getRemainingDelay();
 
     /** Set a callback to be called when devices report their existence 
      *  The visitor will be called once per device, with an empty service.
+     *  The callbacks are run in order by a dedicated thread.
      */
     static unsigned int addCallback(Visitor v);
     static void delCallback(unsigned int idx);
 
+    /** Set a callback to be called when a device goes away, either
+     * because it said so, or because it was not seen for longer than
+     * its advertised lifetime. The visitor is called once per device,
+     * with an empty service, from the callback thread.
+     */
+    static unsigned int addLostCallback(Visitor v);
+    static void delLostCallback(unsigned int idx);
+
     /** Find device by friendlyName or UDN. Unlike traverse, this does
      * not necessarily wait for the initial timeout, it returns as
      * soon as a device with this name reports (or the timeout expires). 
      * Note that "friendly names" are not necessarily unique.
+     *
+     * The DDescH versions return the description shared with the
+     * directory, avoiding a copy.
      */
     bool getDevByFName(const std::string& fname, UPnPDeviceDesc& ddesc);
     bool getDevByUDN(const std::string& udn, UPnPDeviceDesc& ddesc);
+    bool getDevByFName(const std::string& fname, DDescH& ddesc);
+    bool getDevByUDN(const std::string& udn, DDescH& ddesc);
+
+    typedef std::function<void (DDescH)> DevFoundCB;
+
+    /** Asynchronous version of getDevByUDN(), for callers which do
+     * not want to park a thread.
+     *
+     * cb is called exactly once, with the device description, or an
+     * empty pointer if the device did not show up in time. It is called
+     * from the calling thread if the result is immediately known, else
+     * from an internal thread, so it should not linger.
+     *
+     * @param timeoutsecs how long to wait for the device (one second
+     *   resolution). -1 (the default) means until the end of the
+     *   current search window.
+     */
+    void getDevByUDNAsync(const std::string& udn, DevFoundCB cb,
+                          int timeoutsecs = -1);
+
+    /** Retrieve the devices matching a friendly name, a device type, or
+     * offering a service type. The version part of the types is
+     * ignored (e.g. "urn:schemas-upnp-org:service:ContentDirectory:1"
+     * matches any ContentDirectory version). These use indexes instead
+     * of walking the whole pool. Like traverse(), they wait for the
+     * initial search to complete. The results are appended to devs.
+     * @return true if at least one device was found.
+     */
+    bool getDevsByFName(const std::string& fname, std::vector<DDescH>& devs);
+    bool getDevsByType(const std::string& devtype, std::vector<DDescH>& devs);
+    bool getDevsByServiceType(const std::string& stype,
+                              std::vector<DDescH>& devs);
+
+    /** Check if a device was seen on the network during this run (as 
+     * opposed to only reloaded from the pool file) */
+    bool isVerified(const std::string& udn);
+
+    /** Get a copy of the discovery activity counters. This can be
+     * called at any time, even before getTheDir(). */
+    static DiscoveryStats getStats();
+    /** Zero the counters and histograms */
+    static void resetStats();
 
     /** My health */
     bool ok() {return m_ok;}
@@ -97,18 +343,14 @@ private:
 
     // Start UPnP search and record start of timeout
     bool search();
-    // Look at the current pool and remove expired entries
-    void expireDevices();
-
-    // This is called by the thread which processes the device events
-    // when a new device appears. It wakes up any thread waiting for a
-    // device.
-    bool deviceFound(const UPnPDeviceDesc&, const UPnPServiceDesc&);
-
-    // Lookup a device in the pool. If not found and a search is active, 
-    // use a cond_wait to wait for device events (awaken by deviceFound).
-    bool getDevBySelector(bool cmp(const UPnPDeviceDesc&, const std::string&), 
-                          const std::string& value, UPnPDeviceDesc& ddesc);
+    // Expiry thread: remove devices from the pool when their
+    // lifetime is over
+    static void *expiryWorker(void *);
+
+    // Return the devices from one of the pool secondary indexes
+    enum IndexSel {IDX_FNAME, IDX_DEVTYPE, IDX_SERVTYPE};
+    bool getDevsByIndex(IndexSel which, const std::string& key,
+                        std::vector<DDescH>& devs);
 
     static void *discoExplorer(void *);
 
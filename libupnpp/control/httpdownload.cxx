@@ -22,12 +22,23 @@
 #include "config.h"
 
 #include <stdio.h>
-#include <string>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/types.h>
 
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
 #include <curl/curl.h>
 
 #include "libupnpp/log.hxx"
+#include "libupnpp/ptmutex.hxx"
+#include "libupnpp/upnpp_p.hxx"
 #include "libupnpp/control/httpdownload.hxx"
 
 using namespace std;
@@ -44,13 +55,137 @@ write_callback(void *contents, size_t size, size_t nmemb, void *userp)
 }
 
 
-bool downloadUrlWithCurl(const string& url, string& out, long timeoutsecs)
+namespace UPnPP {
+
+// Pool of easy handles for downloadUrlWithCurl(). An easy handle
+// keeps its connections open after a transfer, so reusing handles
+// avoids a new TCP connection for each request to a device. The
+// handles also share the DNS and SSL session caches (and the
+// connection cache when libcurl supports it) through a share object.
+// Idle handles are remembered with the host they last talked to, so
+// that a request preferably gets a handle which can reuse a
+// connection.
+class CurlHandlePool {
+public:
+    CurlHandlePool() {
+        curl_global_init(CURL_GLOBAL_ALL);
+        share = curl_share_init();
+        if (share) {
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockcb);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockcb);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, 
+                              CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+        }
+    }
+
+    CURL *get(const string& hostport) {
+        {
+            PTMutexLocker lock(mutex);
+            stats.requests++;
+            if (!idle.empty()) {
+                auto it = idle.end();
+                while (it != idle.begin()) {
+                    --it;
+                    if (it->first == hostport)
+                        break;
+                }
+                if (it->first != hostport)
+                    it = idle.end() - 1;
+                CURL *curl = it->second;
+                idle.erase(it);
+                curl_easy_reset(curl);
+                return curl;
+            }
+            stats.handles++;
+        }
+        return curl_easy_init();
+    }
+
+    void put(const string& hostport, CURL *curl, bool ok) {
+        long connects = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        PTMutexLocker lock(mutex);
+        if (!ok) {
+            stats.errors++;
+        } else if (connects == 0) {
+            stats.reused++;
+        } else {
+            stats.connects += connects;
+        }
+        idle.push_back(pair<string, CURL*>(hostport, curl));
+        if (idle.size() > maxidle) {
+            curl_easy_cleanup(idle.front().second);
+            idle.pop_front();
+        }
+    }
+
+    static const size_t maxidle = 8;
+    CURLSH *share;
+    PTMutexInit mutex;
+    deque<pair<string, CURL*> > idle;
+    CurlPoolStats stats;
+    PTMutexInit sharelocks[CURL_LOCK_DATA_LAST];
+
+private:
+    static void lockcb(CURL *, curl_lock_data data, curl_lock_access, 
+                       void *userp) {
+        CurlHandlePool *pool = (CurlHandlePool *)userp;
+        pthread_mutex_lock(&pool->sharelocks[data].m_mutex);
+    }
+    static void unlockcb(CURL *, curl_lock_data data, void *userp) {
+        CurlHandlePool *pool = (CurlHandlePool *)userp;
+        pthread_mutex_unlock(&pool->sharelocks[data].m_mutex);
+    }
+};
+
+// Created on first use, never deleted: the handles may be in use by
+// other threads during exit.
+static CurlHandlePool& thePool()
+{
+    static CurlHandlePool *pool = new CurlHandlePool;
+    return *pool;
+}
+
+CurlPoolStats getCurlPoolStats()
+{
+    CurlHandlePool& pool = thePool();
+    PTMutexLocker lock(pool.mutex);
+    return pool.stats;
+}
+
+}
+
+// Pass the data to a user function instead of accumulating it
+typedef std::function<bool (const char *, size_t)> DataSink;
+
+static size_t
+sink_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    DataSink *sink = (DataSink *)userp;
+    // Returning a short count makes curl abort the transfer
+    if (!(*sink)((const char *)contents, realsize))
+        return 0;
+    return realsize;
+}
+
+typedef size_t (*WriteCB)(void *, size_t, size_t, void *);
+
+static bool downloadUrlWithCurl1(const string& url, void *wdata, WriteCB wcb,
+                                 long timeoutsecs)
 {
     CURL *curl;
     CURLcode res;
     bool ret = false;
 
-    curl = curl_easy_init();
+    CurlHandlePool& pool = thePool();
+    string hostport = baseurl(url);
+    curl = pool.get(hostport);
     if(!curl) {
         LOGERR("downloadUrlWithCurl: curl_easy_init failed" << endl);
         return false;
@@ -59,8 +194,10 @@ bool downloadUrlWithCurl(const string& url, string& out, long timeoutsecs)
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeoutsecs);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1); 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &out); 
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, wcb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, wdata); 
+    if (pool.share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, pool.share);
     res = curl_easy_perform(curl);
     if(res != CURLE_OK) {
         LOGERR("downloadUrlWithCurl: curl_easy_perform(): " << 
@@ -68,7 +205,331 @@ bool downloadUrlWithCurl(const string& url, string& out, long timeoutsecs)
     } else {
         ret = true;
     }
-    curl_easy_cleanup(curl);
+    pool.put(hostport, curl, ret);
 
     return ret;
 }
+
+bool downloadUrlWithCurl(const string& url, string& out, long timeoutsecs)
+{
+    return downloadUrlWithCurl1(url, &out, write_callback, timeoutsecs);
+}
+
+bool downloadUrlWithCurl(const string& url, DataSink sink, long timeoutsecs)
+{
+    return downloadUrlWithCurl1(url, &sink, sink_callback, timeoutsecs);
+}
+
+namespace UPnPP {
+
+// One transfer in progress
+class FetchJob {
+public:
+    FetchJob(const string& u, CurlMultiFetcher::FetchCB c, const string& et,
+             const string& lm, CurlMultiFetcher::DataCB dc)
+        : url(u), cb(c), ifnonematch(et), ifmodifiedsince(lm), datacb(dc),
+          curl(0), headers(0) {}
+    ~FetchJob() {
+        if (headers)
+            curl_slist_free_all(headers);
+    }
+    void done() {
+        cb(url, result);
+    }
+    string url;
+    CurlMultiFetcher::FetchCB cb;
+    string ifnonematch;
+    string ifmodifiedsince;
+    CurlMultiFetcher::DataCB datacb;
+    CURL *curl;
+    struct curl_slist *headers;
+    CurlMultiFetcher::FetchResult result;
+};
+
+// Extract the validators from the response headers
+static size_t header_callback(char *buffer, size_t size, size_t nitems,
+                              void *userp)
+{
+    size_t realsize = size * nitems;
+    CurlMultiFetcher::FetchResult *res = 
+        (CurlMultiFetcher::FetchResult *)userp;
+    string line(buffer, realsize);
+    string::size_type colon = line.find(':');
+    if (colon == string::npos)
+        return realsize;
+    string name = line.substr(0, colon);
+    string value = line.substr(colon + 1);
+    trimstring(name);
+    trimstring(value, " \t\r\n");
+    if (!strcasecmp(name.c_str(), "etag")) {
+        res->etag = value;
+    } else if (!strcasecmp(name.c_str(), "last-modified")) {
+        res->lastmodified = value;
+    }
+    return realsize;
+}
+
+class CurlMultiFetcher::Internal {
+public:
+    Internal(int maxpar, long tmo)
+        : maxparallel(maxpar > 0 ? maxpar : 1), timeoutsecs(tmo),
+          multi(0), running(false), stopping(false) {
+        wakepipe[0] = wakepipe[1] = -1;
+    }
+
+    int maxparallel;
+    long timeoutsecs;
+    CURLM *multi;
+    int wakepipe[2];
+    pthread_t thread;
+    bool running;
+
+    // Protects the input queue and the stopping flag, which are the only
+    // things shared with the client threads. The active map is only
+    // touched by the worker.
+    PTMutexInit mutex;
+    bool stopping;
+    deque<FetchJob*> queue;
+    unordered_map<CURL*, FetchJob*> active;
+
+    static void *workproc(void *);
+    void startJob(FetchJob *job);
+    void finishJob(CURL *curl, bool ok);
+    // Free the multi handle and the wake pipe, if allocated
+    void release() {
+        if (multi) {
+            curl_multi_cleanup(multi);
+            multi = 0;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (wakepipe[i] >= 0)
+                close(wakepipe[i]);
+            wakepipe[i] = -1;
+        }
+    }
+    void wakeup() {
+        char c = 0;
+        if (write(wakepipe[1], &c, 1) < 0 && errno != EAGAIN) {
+            LOGERR("CurlMultiFetcher: wake pipe write failed errno " <<
+                   errno << endl);
+        }
+    }
+};
+
+CurlMultiFetcher::CurlMultiFetcher(int maxparallel, long timeoutsecs)
+{
+    if ((m = new Internal(maxparallel, timeoutsecs)) == 0) {
+        LOGERR("CurlMultiFetcher: out of memory" << endl);
+        return;
+    }
+}
+
+CurlMultiFetcher::~CurlMultiFetcher()
+{
+    terminate();
+    delete m;
+    m = 0;
+}
+
+bool CurlMultiFetcher::ok() const
+{
+    return m && m->running;
+}
+
+bool CurlMultiFetcher::start()
+{
+    if (m == 0)
+        return false;
+    if (m->running)
+        return true;
+    curl_global_init(CURL_GLOBAL_ALL);
+    if ((m->multi = curl_multi_init()) == 0) {
+        LOGERR("CurlMultiFetcher::start: curl_multi_init failed" << endl);
+        return false;
+    }
+    if (pipe(m->wakepipe) < 0) {
+        LOGERR("CurlMultiFetcher::start: pipe() failed errno " << errno << 
+               endl);
+        m->wakepipe[0] = m->wakepipe[1] = -1;
+        m->release();
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(m->wakepipe[i], F_SETFL, 
+              fcntl(m->wakepipe[i], F_GETFL) | O_NONBLOCK);
+    }
+    m->stopping = false;
+    if (pthread_create(&m->thread, 0, Internal::workproc, m)) {
+        LOGERR("CurlMultiFetcher::start: pthread_create failed" << endl);
+        m->release();
+        return false;
+    }
+    m->running = true;
+    return true;
+}
+
+void CurlMultiFetcher::terminate()
+{
+    if (m == 0 || !m->running)
+        return;
+    {
+        PTMutexLocker lock(m->mutex);
+        m->stopping = true;
+    }
+    m->wakeup();
+    pthread_join(m->thread, 0);
+    m->running = false;
+
+    // Fail whatever was still waiting
+    for (auto it = m->queue.begin(); it != m->queue.end(); it++) {
+        (*it)->done();
+        delete *it;
+    }
+    m->queue.clear();
+    m->release();
+}
+
+bool CurlMultiFetcher::fetch(const string& url, FetchCB cb,
+                             const string& etag, const string& lastmodified,
+                             DataCB datacb)
+{
+    if (m == 0 || !m->running)
+        return false;
+    {
+        PTMutexLocker lock(m->mutex);
+        if (m->stopping)
+            return false;
+        m->queue.push_back(new FetchJob(url, cb, etag, lastmodified, datacb));
+    }
+    m->wakeup();
+    return true;
+}
+
+void CurlMultiFetcher::Internal::startJob(FetchJob *job)
+{
+    job->curl = curl_easy_init();
+    if (job->curl == 0) {
+        LOGERR("CurlMultiFetcher: curl_easy_init failed" << endl);
+        job->done();
+        delete job;
+        return;
+    }
+    curl_easy_setopt(job->curl, CURLOPT_URL, job->url.c_str());
+    curl_easy_setopt(job->curl, CURLOPT_TIMEOUT, timeoutsecs);
+    curl_easy_setopt(job->curl, CURLOPT_NOSIGNAL, 1); 
+    curl_easy_setopt(job->curl, CURLOPT_FAILONERROR, 1); 
+    if (job->datacb) {
+        curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, sink_callback);
+        curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, &job->datacb); 
+    } else {
+        curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, &job->result.data); 
+    }
+    curl_easy_setopt(job->curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(job->curl, CURLOPT_HEADERDATA, &job->result);
+    if (!job->ifnonematch.empty()) {
+        job->headers = curl_slist_append(job->headers, 
+                             (string("If-None-Match: ") + 
+                              job->ifnonematch).c_str());
+    }
+    if (!job->ifmodifiedsince.empty()) {
+        job->headers = curl_slist_append(job->headers, 
+                             (string("If-Modified-Since: ") + 
+                              job->ifmodifiedsince).c_str());
+    }
+    if (job->headers)
+        curl_easy_setopt(job->curl, CURLOPT_HTTPHEADER, job->headers);
+    curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+    active[job->curl] = job;
+    curl_multi_add_handle(multi, job->curl);
+}
+
+void CurlMultiFetcher::Internal::finishJob(CURL *curl, bool ok)
+{
+    auto it = active.find(curl);
+    if (it == active.end()) {
+        LOGERR("CurlMultiFetcher: finished handle not found" << endl);
+        return;
+    }
+    FetchJob *job = it->second;
+    active.erase(it);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &job->result.httpcode);
+    job->result.ok = ok;
+    curl_multi_remove_handle(multi, curl);
+    curl_easy_cleanup(curl);
+    job->done();
+    delete job;
+}
+
+void *CurlMultiFetcher::Internal::workproc(void *arg)
+{
+    Internal *m = (Internal *)arg;
+
+    for (;;) {
+        vector<FetchJob*> newjobs;
+        {
+            PTMutexLocker lock(m->mutex);
+            if (m->stopping)
+                break;
+            while (int(m->active.size() + newjobs.size()) < m->maxparallel &&
+                   !m->queue.empty()) {
+                newjobs.push_back(m->queue.front());
+                m->queue.pop_front();
+            }
+        }
+        for (auto it = newjobs.begin(); it != newjobs.end(); it++) {
+            m->startJob(*it);
+        }
+
+        int stillrunning;
+        curl_multi_perform(m->multi, &stillrunning);
+
+        CURLMsg *msg;
+        int msgsleft;
+        int finished = 0;
+        while ((msg = curl_multi_info_read(m->multi, &msgsleft))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            bool ok = msg->data.result == CURLE_OK;
+            if (!ok) {
+                char *priv = 0;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+                LOGERR("CurlMultiFetcher: " << 
+                       (priv ? ((FetchJob*)priv)->url : string()) << " : " <<
+                       curl_easy_strerror(msg->data.result) << endl);
+            }
+            m->finishJob(msg->easy_handle, ok);
+            finished++;
+        }
+        // Slots were freed: start the waiting jobs at once instead of
+        // sleeping (if no transfer is active, nothing would wake us up
+        // before the timeout).
+        if (finished) {
+            PTMutexLocker lock(m->mutex);
+            if (!m->queue.empty())
+                continue;
+        }
+
+        // Sleep until there is socket activity, a new request, or the
+        // timeout (which lets curl check its own timers)
+        struct curl_waitfd wfd;
+        wfd.fd = m->wakepipe[0];
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+        int numfds;
+        curl_multi_wait(m->multi, &wfd, 1, 1000, &numfds);
+        if (wfd.revents) {
+            char buf[100];
+            while (read(m->wakepipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+    }
+
+    // Abort the transfers still in progress
+    while (!m->active.empty()) {
+        m->finishJob(m->active.begin()->first, false);
+    }
+    return (void*)1;
+}
+
+} // namespace UPnPP
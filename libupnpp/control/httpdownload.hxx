@@ -1,9 +1,117 @@
 #ifndef _HTTPDOWNLOAD_H_X_INCLUDED_
 #define _HTTPDOWNLOAD_H_X_INCLUDED_
 
+#include <functional>
 #include <string>
 
-extern bool downloadUrlWithCurl(const std::string& url, 
+/** Download a document, synchronously. The curl handles are pooled and 
+ * keep their connections open, so that successive requests to the same 
+ * host can reuse a connection. */
+extern bool downloadUrlWithCurl(const std::string& url,
                                 std::string& out, long timeoutsecs);
 
+/** Download a document, passing the data to sink as it arrives instead
+ * of accumulating it (e.g. to parse it on the fly). If sink returns 
+ * false, the transfer is aborted and the call fails. */
+extern bool downloadUrlWithCurl(
+    const std::string& url, std::function<bool (const char *, size_t)> sink,
+    long timeoutsecs);
+
+namespace UPnPP {
+
+/** Connection reuse counters for downloadUrlWithCurl() */
+class CurlPoolStats {
+public:
+    CurlPoolStats() : requests(0), handles(0), reused(0), connects(0),
+                      errors(0) {}
+    // Calls to downloadUrlWithCurl()
+    long long requests;
+    // Easy handles created (the others were reused from the pool)
+    long long handles;
+    // Successful transfers which used an existing connection
+    long long reused;
+    // New connections opened by the successful transfers
+    long long connects;
+    // Failed transfers
+    long long errors;
+};
+extern CurlPoolStats getCurlPoolStats();
+
+/**
+ * Run many HTTP downloads concurrently from a single thread, using a
+ * curl multi handle.
+ *
+ * fetch() queues a request and returns immediately, so that it can
+ * be called from contexts which must not block (e.g. libupnp callback
+ * threads). The completion function is called from the download
+ * thread when the transfer is done or has failed, so it should not
+ * linger either.
+ */
+class CurlMultiFetcher {
+public:
+    /** Transfer result, passed to the completion function. */
+    struct FetchResult {
+        FetchResult() : ok(false), httpcode(0) {}
+        // False if the transfer failed.
+        bool ok;
+        // HTTP status. 304 if a conditional request found the document
+        // unchanged, in which case data is empty.
+        long httpcode;
+        // The document. Can be swapped out by the callee.
+        std::string data;
+        // Validators returned by the server, for use in later conditional
+        // requests. May be empty.
+        std::string etag;
+        std::string lastmodified;
+    };
+    typedef std::function<void (const std::string& url, 
+                                FetchResult& result)> FetchCB;
+    /** Data sink, see fetch() */
+    typedef std::function<bool (const char *data, size_t len)> DataCB;
+
+    /**
+     * @param maxparallel maximum number of simultaneous transfers.
+     *    Requests beyond this are queued.
+     * @param timeoutsecs timeout for a single transfer, including the
+     *    connection phase.
+     */
+    CurlMultiFetcher(int maxparallel = 20, long timeoutsecs = 5);
+    ~CurlMultiFetcher();
+
+    /** Start the download thread */
+    bool start();
+
+    /** Queue a download request. Does not block. 
+     *
+     * @param url the document to fetch.
+     * @param cb the completion function.
+     * @param etag if not empty, send an If-None-Match header to make the 
+     *    request conditional.
+     * @param lastmodified if not empty, send an If-Modified-Since header.
+     * @param datacb if set, the document data is passed to this 
+     *    function as it arrives, in the download thread, instead of
+     *    being accumulated into result.data. Returning false aborts the
+     *    transfer.
+     */
+    bool fetch(const std::string& url, FetchCB cb,
+               const std::string& etag = std::string(),
+               const std::string& lastmodified = std::string(),
+               DataCB datacb = DataCB());
+
+    /** Stop the download thread. Pending requests are failed (their
+     * callbacks are called with result.ok == false) */
+    void terminate();
+
+    bool ok() const;
+
+private:
+    class Internal;
+    Internal *m;
+
+    CurlMultiFetcher(const CurlMultiFetcher&) = delete;
+    CurlMultiFetcher& operator=(const CurlMultiFetcher&) = delete;
+};
+
+}
+
 #endif /* _HTTPDOWNLOAD.H_X_INCLUDED_ */
@@ -20,7 +20,7 @@
 #include <functional>                   // for _Bind, bind, _1, _2
 #include <ostream>                      // for endl
 #include <string>                       // for string
-#include <unordered_map>                // for unordered_map, etc
+#include <unordered_set>                // for unordered_set
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
@@ -46,43 +46,54 @@ bool MediaRenderer::isMRDevice(const string& st)
     return !DType.compare(0, sz, st, 0, sz);
 }
 
-// Look at all service descriptions and store parent devices for
-// either UPnP RenderingControl or OpenHome Product. Some entries will
-// be set multiple times, which does not matter
-static bool MDAccum(unordered_map<string, UPnPDeviceDesc>* out,
-                    const string& friendlyName,
-                    const UPnPDeviceDesc& device, 
-                    const UPnPServiceDesc& service)
+static bool isMR(const UPnPDeviceDesc& device)
 {
-    //LOGDEB("MDAccum: friendlyname: " << friendlyName << 
-    //    " dev friendlyName " << device.friendlyName << endl);
-    if (
-        (RenderingControl::isRDCService(service.serviceType) ||
-         OHProduct::isOHPrService(service.serviceType))
-        &&
-        (friendlyName.empty() || !friendlyName.compare(device.friendlyName))) {
-        //LOGDEB("MDAccum setting " << device.UDN << endl);
-        (*out)[device.UDN] = device;
+    for (auto it = device.services.begin(); it != device.services.end(); it++){
+        if (RenderingControl::isRDCService(it->serviceType) ||
+            OHProduct::isOHPrService(it->serviceType))
+            return true;
     }
-    return true;
+    return false;
 }
 
+// Retrieve the devices with either a UPnP RenderingControl or an
+// OpenHome Product service, using the directory indexes.
 bool MediaRenderer::getDeviceDescs(vector<UPnPDeviceDesc>& devices, 
                                    const string& friendlyName)
 {
-    unordered_map<string, UPnPDeviceDesc> mydevs;
+    UPnPDeviceDirectory *dir = UPnPDeviceDirectory::getTheDir();
+    vector<DDescH> candidates;
+    if (!friendlyName.empty()) {
+        dir->getDevsByFName(friendlyName, candidates);
+        for (auto it = candidates.begin(); it != candidates.end(); it++) {
+            if (isMR(**it))
+                devices.push_back(**it);
+        }
+        return !devices.empty();
+    }
 
-    UPnPDeviceDirectory::Visitor visitor = bind(MDAccum, &mydevs, friendlyName,
-                                                _1, _2);
-    UPnPDeviceDirectory::getTheDir()->traverse(visitor);
-    for (auto it = mydevs.begin(); it != mydevs.end(); it++)
-        devices.push_back(it->second);
+    // A device can have both services, only list it once
+    unordered_set<string> seen;
+    dir->getDevsByServiceType(RenderingControl::SType, candidates);
+    dir->getDevsByServiceType(OHProduct::SType, candidates);
+    for (auto it = candidates.begin(); it != candidates.end(); it++) {
+        if (seen.insert((*it)->UDN).second)
+            devices.push_back(**it);
+    }
     return !devices.empty();
 }
 
 MediaRenderer::MediaRenderer(const UPnPDeviceDesc& desc)
     : Device(desc)
 {
+    // The RenderingControl constructor needs the service description:
+    // get the download going.
+    for (auto it = desc.services.begin(); it != desc.services.end(); it++) {
+        if (RenderingControl::isRDCService(it->serviceType)) {
+            SCPDCache::prefetch(desc, *it);
+            break;
+        }
+    }
 }
 
 bool MediaRenderer::hasOpenHome()
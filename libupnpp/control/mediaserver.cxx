@@ -20,7 +20,6 @@
 #include <functional>                   // for _Bind, bind, _1, _2
 #include <ostream>                      // for endl
 #include <string>                       // for string
-#include <unordered_map>                // for unordered_map, etc
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
@@ -46,32 +45,29 @@ bool MediaServer::isMSDevice(const string& st)
     return !DType.compare(0, sz, st, 0, sz);
 }
 
-static bool MDAccum(unordered_map<string, UPnPDeviceDesc>* out,
-                    const string& friendlyName,
-                    const UPnPDeviceDesc& device, 
-                    const UPnPServiceDesc& service)
-{
-    //LOGDEB("MDAccum: friendlyname: " << friendlyName << 
-    //    " dev friendlyName " << device.friendlyName << endl);
-    if (ContentDirectory::isCDService(service.serviceType) &&
-        (friendlyName.empty() ? true : 
-         !friendlyName.compare(device.friendlyName))) {
-        //LOGDEB("MDAccum setting " << device.UDN << endl);
-        (*out)[device.UDN] = device;
-    }
-    return true;
-}
-
 bool MediaServer::getDeviceDescs(vector<UPnPDeviceDesc>& devices, 
                                    const string& friendlyName)
 {
-    unordered_map<string, UPnPDeviceDesc> mydevs;
+    UPnPDeviceDirectory *dir = UPnPDeviceDirectory::getTheDir();
+    vector<DDescH> candidates;
+    if (friendlyName.empty()) {
+        dir->getDevsByServiceType(ContentDirectory::SType, candidates);
+        for (auto it = candidates.begin(); it != candidates.end(); it++) {
+            devices.push_back(**it);
+        }
+        return !devices.empty();
+    }
 
-    UPnPDeviceDirectory::Visitor visitor = bind(MDAccum, &mydevs, friendlyName,
-                                                _1, _2);
-    UPnPDeviceDirectory::getTheDir()->traverse(visitor);
-    for (auto it = mydevs.begin(); it != mydevs.end(); it++)
-        devices.push_back(it->second);
+    dir->getDevsByFName(friendlyName, candidates);
+    for (auto it = candidates.begin(); it != candidates.end(); it++) {
+        for (auto sit = (*it)->services.begin(); sit != (*it)->services.end(); 
+             sit++) {
+            if (ContentDirectory::isCDService(sit->serviceType)) {
+                devices.push_back(**it);
+                break;
+            }
+        }
+    }
     return !devices.empty();
 }
 
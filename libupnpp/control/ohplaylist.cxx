@@ -51,6 +51,12 @@ bool OHPlaylist::isOHPlService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool OHPlaylist::isOHPlService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 static int stringToTpState(const string& value, OHPlaylist::TPState *tpp)
 {
     if (!value.compare("Buffering")) {
@@ -52,6 +52,9 @@ public:
 
     /** Test service type from discovery message */
     static bool isOHPlService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isOHPlService(const UPnPP::IString& st);
 
     int play();
     int pause();
@@ -105,6 +105,12 @@ bool OHProduct::isOHPrService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool OHProduct::isOHPrService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 int OHProduct::getSources(vector<Source>& sources)
 {
     SoapOutgoing args(getServiceType(), "SourceXml");
@@ -46,6 +46,11 @@ public:
 
     /** Test service type from discovery message */
     static bool isOHPrService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isOHPrService(const UPnPP::IString& st);
+    /** My service type string */
+    static const std::string SType;
 
     struct Source {
         std::string name;
@@ -57,10 +62,6 @@ public:
 
     /** @ret 0 for success, upnp error else */
     int getSources(std::vector<Source>& sources);
-
-protected:
-    /* My service type string */
-    static const std::string SType;
 };
 
 } // namespace UPnPClient
@@ -45,6 +45,12 @@ bool OHTime::isOHTMService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool OHTime::isOHTMService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 void OHTime::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
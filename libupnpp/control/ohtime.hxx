@@ -51,6 +51,9 @@ public:
 
     /** Test service type from discovery message */
     static bool isOHTMService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isOHTMService(const UPnPP::IString& st);
 
     struct Time {
         int trackCount;
@@ -46,6 +46,12 @@ bool OHVolume::isOHVLService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool OHVolume::isOHVLService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 void OHVolume::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
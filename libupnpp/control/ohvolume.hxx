@@ -57,6 +57,9 @@ public:
 
     /** Test service type from discovery message */
     static bool isOHVLService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isOHVLService(const UPnPP::IString& st);
 
     int volume(int *value);
     int setVolume(int value);
@@ -50,14 +50,22 @@ bool RenderingControl::isRDCService(const string& st)
     return !SType.compare(0, sz, st, 0, sz);
 }
 
+bool RenderingControl::isRDCService(const IString& st)
+{
+    static const IString base(IString(SType).base());
+    return st.base() == base;
+}
+
 RenderingControl::RenderingControl(const UPnPDeviceDesc& device,
                                    const UPnPServiceDesc& service)
     : Service(device, service), m_volmin(0), m_volmax(100), m_volstep(1)
 {
-    UPnPServiceDesc::Parsed sdesc;
-    if (service.fetchAndParseDesc(device.URLBase, sdesc)) {
-        auto it = sdesc.stateTable.find("Volume");
-        if (it != sdesc.stateTable.end() && it->second.hasValueRange) {
+    // Usually a cache hit: the MediaRenderer prefetches the
+    // description, and it is shared by devices of the same model.
+    SCPDCache::ParsedH sdesc = SCPDCache::get(device, service);
+    if (sdesc) {
+        auto it = sdesc->stateTable.find("Volume");
+        if (it != sdesc->stateTable.end() && it->second.hasValueRange) {
             setVolParams(it->second.minimum, it->second.maximum,
                          it->second.step);
         }
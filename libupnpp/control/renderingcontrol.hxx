@@ -49,6 +49,11 @@ public:
 
     /** Test service type from discovery message */
     static bool isRDCService(const std::string& st);
+    /** Same, for an interned type from a description. This is a
+     *  pointer compare */
+    static bool isRDCService(const UPnPP::IString& st);
+    /** My service type string */
+    static const std::string SType;
 
     /** @ret 0 for success, upnp error else */
     int setVolume(int volume, const std::string& channel = "Master");
@@ -57,9 +62,6 @@ public:
     bool getMute(const std::string& channel = "Master");
 
 protected:
-    /* My service type string */
-    static const std::string SType;
-
     /* Volume settings params */
     int m_volmin;
     int m_volmax;
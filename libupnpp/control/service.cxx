@@ -16,20 +16,33 @@
  */
 #include "libupnpp/control/service.hxx"
 
+#include <errno.h>                      // for ETIMEDOUT
+#include <pthread.h>                    // for pthread_cond_wait, etc
+#include <string.h>                     // for strncpy
+#include <time.h>                       // for timespec
 #include <upnp/upnp.h>                  // for Upnp_Event, UPNP_E_SUCCESS, etc
 #include <upnp/upnptools.h>             // for UpnpGetErrorMessage
 
+#include <algorithm>                    // for find, remove
+#include <deque>                        // for deque
 #include <functional>                   // for function
+#include <future>                       // for promise, future
+#include <memory>                       // for shared_ptr
 #include <string>                       // for string, char_traits, etc
 #include <unordered_map>                // for unordered_map, operator!=, etc
 #include <utility>                      // for pair
+#include <vector>                       // for vector
 
 #include "libupnpp/control/description.hxx"  // for UPnPDeviceDesc, etc
+#include "libupnpp/control/discovery.hxx"  // for UPnPDeviceDirectory
+#include "libupnpp/control/soaptransport.hxx"  // for SoapTransport
 #include "libupnpp/ixmlwrap.hxx"
 #include "libupnpp/log.hxx"             // for LOGDEB1, LOGINF, LOGERR, etc
 #include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
 #include "libupnpp/upnpp_p.hxx"         // for caturl
 #include "libupnpp/upnpplib.hxx"        // for LibUPnP
+#include "libupnpp/upnpputils.hxx"      // for timespec_addnanos, usecsnow
+#include "libupnpp/workqueue.hxx"       // for WorkQueue
 
 using namespace std;
 using namespace std::placeholders;
@@ -51,11 +64,43 @@ public:
      }
 };
 
+class SubsRequest;
+
+// The reporters installed on a service. The registry handles are
+// shared by several clients, each with its own reporter, so the
+// events go to all of them. The lock is held while calling them, so
+// that a reporter is not used after removeReporter() returns.
+class ReporterList : public VarEventReporter {
+public:
+    virtual void changed(const char *nm, int val) {
+        PTMutexLocker lock(mutex);
+        for (auto it = list.begin(); it != list.end(); it++)
+            (*it)->changed(nm, val);
+    }
+    virtual void changed(const char *nm, const char *val) {
+        PTMutexLocker lock(mutex);
+        for (auto it = list.begin(); it != list.end(); it++)
+            (*it)->changed(nm, val);
+    }
+    virtual void changed(const char *nm, UPnPDirObject meta) {
+        PTMutexLocker lock(mutex);
+        for (auto it = list.begin(); it != list.end(); it++)
+            (*it)->changed(nm, meta);
+    }
+    virtual void changed(const char *nm, std::vector<int> ids) {
+        PTMutexLocker lock(mutex);
+        for (auto it = list.begin(); it != list.end(); it++)
+            (*it)->changed(nm, ids);
+    }
+    PTMutexInit mutex;
+    vector<VarEventReporter*> list;
+};
+
 class Service::Internal {
 public:
     /** Upper level client code event callbacks. To be called by derived class
      * for reporting events. */
-    VarEventReporter *reporter;
+    ReporterList reporters;
     std::string actionURL;
     std::string eventURL;
     std::string serviceType;
@@ -64,6 +109,22 @@ public:
     std::string manufacturer;
     std::string modelName;
     Upnp_SID    SID; /* Subscription Id */
+    // The following are protected by cblock.
+    // Event callback, entered in o_calls when the subscription completes
+    evtCBFunc evtcb;
+    SubsStatus substatus;
+    // Subscription request in progress, if any
+    SubsRequest *subsreq;
+    vector<SubsReadyCB> readycbs;
+};
+
+// An asynchronous subscription request, passed as cookie to libupnp.
+// The service pointer is reset if the object is deleted before the
+// request completes.
+class SubsRequest {
+public:
+    SubsRequest(Service *_service) : service(_service) {}
+    Service *service;
 };
 
 /** Registered callbacks for the service objects. The map is
@@ -73,6 +134,10 @@ public:
  * libupnp to call the appropriate object method when it receives
  * an event. */
 static std::unordered_map<std::string, evtCBFunc> o_calls;
+// Protects o_calls and the subscription state of the Service objects
+static PTMutexInit cblock;
+// Signalled when a subscription completes, for waitSubscribed()
+static pthread_cond_t o_subscond = PTHREAD_COND_INITIALIZER;
 
 
 Service::Service(const UPnPDeviceDesc& devdesc,
@@ -83,7 +148,8 @@ Service::Service(const UPnPDeviceDesc& devdesc,
         return;
     }
 
-    m->reporter = 0;
+    m->substatus = SUBS_NONE;
+    m->subsreq = 0;
     m->actionURL = caturl(devdesc.URLBase, servdesc.controlURL);
     m->eventURL = caturl(devdesc.URLBase, servdesc.eventSubURL);
     m->serviceType = servdesc.serviceType;
@@ -102,12 +168,20 @@ Service::Service()
         LOGERR("Device::Device: out of memory" << endl);
         return;
     }
-    m->reporter = 0;
+    m->substatus = SUBS_NONE;
+    m->subsreq = 0;
 }
 
 Service::~Service()
 {
     LOGDEB("Service::~Service: " << m->serviceType << " SID " << m->SID << endl);
+    {
+        // Not all derived classes call unregisterCallback(), make
+        // sure that a pending subscription won't touch us.
+        PTMutexLocker lock(cblock);
+        if (m->subsreq)
+            m->subsreq->service = 0;
+    }
     delete m;
     m = 0;
 }
@@ -144,19 +218,41 @@ const string& Service::getManufacturer() const
 
 VarEventReporter *Service::getReporter()
 {
-    return m->reporter;
+    PTMutexLocker lock(m->reporters.mutex);
+    return m->reporters.list.empty() ? 0 : &m->reporters;
 }
 
 void Service::installReporter(VarEventReporter* reporter)
 {
-    m->reporter = reporter;
+    PTMutexLocker lock(m->reporters.mutex);
+    vector<VarEventReporter*>& list = m->reporters.list;
+    if (reporter == 0) {
+        list.clear();
+    } else if (find(list.begin(), list.end(), reporter) == list.end()) {
+        list.push_back(reporter);
+    }
 }
 
-int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
+void Service::removeReporter(VarEventReporter* reporter)
 {
+    PTMutexLocker lock(m->reporters.mutex);
+    vector<VarEventReporter*>& list = m->reporters.list;
+    list.erase(remove(list.begin(), list.end(), reporter), list.end());
+}
+
+// Perform an action, either through the keep-alive transport or
+// libupnp. This does not use the Service object, so that it can be
+// called from the asynchronous action workers.
+static int sendAction(const string& actionURL, const SoapOutgoing& args,
+                      SoapIncoming& data)
+{
+    if (SoapTransport::enabled()) {
+        return SoapTransport::runAction(actionURL, args, data);
+    }
+
     LibUPnP* lib = LibUPnP::getLibUPnP();
     if (lib == 0) {
-        LOGINF("Service::runAction: no lib" << endl);
+        LOGINF("sendAction: no lib" << endl);
         return UPNP_E_OUTOF_MEMORY;
     }
     UpnpClient_Handle hdl = lib->getclh();
@@ -166,33 +262,430 @@ int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
     IxmlCleaner cleaner(&request, &response);
 
     if ((request = args.buildSoapBody(false)) == 0) {
-        LOGINF("Service::runAction: buildSoapBody failed" << endl);
+        LOGINF("sendAction: buildSoapBody failed" << endl);
         return  UPNP_E_OUTOF_MEMORY;
     }
 
-    LOGDEB1("Service::runAction: rqst: [" << 
+    LOGDEB1("sendAction: rqst: [" << 
             ixmlwPrintDoc(request) << "]" << endl);
 
-    int ret = UpnpSendAction(hdl, m->actionURL.c_str(), m->serviceType.c_str(),
+    int ret = UpnpSendAction(hdl, actionURL.c_str(),
+                             args.getServiceType().c_str(),
                              0 /*devUDN*/, request, &response);
 
     if (ret != UPNP_E_SUCCESS) {
-        LOGINF("Service::runAction: UpnpSendAction failed: " << ret << 
+        LOGINF("sendAction: UpnpSendAction failed: " << ret << 
                " : " << UpnpGetErrorMessage(ret) << " for " << 
                ixmlwPrintDoc(request) << endl);
         return ret;
     }
-    LOGDEB1("Service::runAction: rslt: [" << 
+    LOGDEB1("sendAction: rslt: [" << 
             ixmlwPrintDoc(response) << "]" << endl);
 
     if (!data.decode(args.getName().c_str(), response)) {
-        LOGERR("Service::runAction: Could not decode response: " <<
+        LOGERR("sendAction: Could not decode response: " <<
                ixmlwPrintDoc(response) << endl);
         return UPNP_E_BAD_RESPONSE;
     }
     return UPNP_E_SUCCESS;
 }
 
+int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
+{
+    return sendAction(m->actionURL, args, data);
+}
+
+// Asynchronous actions. The tasks are executed by the threads of
+// o_actionQueue, whose number bounds the requests in progress. The
+// requests for a device beyond its limit are held in its waiting list
+// until one of its previous requests completes. The pool also runs
+// some internal jobs, which are not counted against a device.
+class ActionTask {
+public:
+    ActionTask(const string& url, const SoapOutgoing& _args)
+        : actionURL(url), hostport(baseurl(url)), args(_args), data(&own) {}
+    ActionTask(std::function<void ()> _job)
+        : data(&own), job(_job) {}
+    string actionURL;
+    string hostport;
+    SoapOutgoing args;
+    // Response destination: own, or the caller's for the future version
+    SoapIncoming own;
+    SoapIncoming *data;
+    Service::ActionCB cb;
+    // If set and returning true when the task comes up, the action is
+    // not sent and cb gets UPNP_E_TIMEDOUT.
+    std::function<bool ()> cancelled;
+    // Internal job: run instead of an action
+    std::function<void ()> job;
+};
+
+class ActionHost {
+public:
+    ActionHost() : inflight(0) {}
+    // Requests queued or running
+    int inflight;
+    deque<ActionTask*> waiting;
+};
+
+static WorkQueue<ActionTask*> o_actionQueue("AsyncActions");
+// Protects the following
+static PTMutexInit o_actionmutex;
+static bool o_actionstarted;
+// Set by terminateAsync(): no new requests, queued ones are not sent
+static bool o_actionterminating;
+static int o_actionperdevice = 2;
+static int o_actionglobal = 8;
+static unordered_map<string, ActionHost> o_actionhosts;
+
+void Service::setAsyncLimits(int perdevice, int global)
+{
+    PTMutexLocker lock(o_actionmutex);
+    o_actionperdevice = perdevice > 0 ? perdevice : 1;
+    if (o_actionstarted) {
+        LOGINF("Service::setAsyncLimits: pool already started, "
+               "global limit unchanged" << endl);
+    } else {
+        o_actionglobal = global > 0 ? global : 1;
+    }
+}
+
+// A request for hostport completed: start the next waiting one, if
+// any. The host entry is erased when it goes idle. Called with
+// o_actionmutex held.
+static ActionTask *actionDoneLocked(const string& hostport)
+{
+    auto it = o_actionhosts.find(hostport);
+    if (it == o_actionhosts.end())
+        return 0;
+    ActionHost& host = it->second;
+    host.inflight--;
+    ActionTask *next = 0;
+    if (!o_actionterminating && !host.waiting.empty() &&
+        host.inflight < o_actionperdevice) {
+        next = host.waiting.front();
+        host.waiting.pop_front();
+        host.inflight++;
+    }
+    if (host.inflight <= 0 && host.waiting.empty())
+        o_actionhosts.erase(it);
+    return next;
+}
+
+static void actionDone(const string& hostport)
+{
+    ActionTask *next = 0;
+    {
+        PTMutexLocker lock(o_actionmutex);
+        next = actionDoneLocked(hostport);
+    }
+    if (next && !o_actionQueue.put(next)) {
+        // Queue terminated (exiting)
+        actionDone(next->hostport);
+        delete next;
+    }
+}
+
+static void *actionWorker(void *)
+{
+    for (;;) {
+        ActionTask *tsk = 0;
+        if (!o_actionQueue.take(&tsk)) {
+            o_actionQueue.workerExit();
+            return (void*)1;
+        }
+        if (tsk->job) {
+            tsk->job();
+            delete tsk;
+            continue;
+        }
+        bool terminating;
+        {
+            PTMutexLocker lock(o_actionmutex);
+            terminating = o_actionterminating;
+        }
+        int ret = UPNP_E_TIMEDOUT;
+        if (terminating) {
+            ret = UPNP_E_FINISH;
+        } else if (!tsk->cancelled || !tsk->cancelled()) {
+            ret = sendAction(tsk->actionURL, tsk->args, *tsk->data);
+        }
+        if (tsk->cb)
+            tsk->cb(ret, *tsk->data);
+        actionDone(tsk->hostport);
+        delete tsk;
+    }
+}
+
+// Start the pool if needed. Called with o_actionmutex held.
+static bool startActionPool()
+{
+    if (o_actionterminating)
+        return false;
+    if (!o_actionstarted) {
+        if (!o_actionQueue.start(o_actionglobal, actionWorker, 0)) {
+            LOGERR("Service::runActionAsync: can't start the worker "
+                   "threads" << endl);
+            return false;
+        }
+        o_actionstarted = true;
+    }
+    return true;
+}
+
+// Run an internal job in the pool. Returns false if the pool is not
+// available, the caller should then do the work itself.
+static bool queueJob(std::function<void ()> job)
+{
+    {
+        PTMutexLocker lock(o_actionmutex);
+        if (!startActionPool())
+            return false;
+    }
+    ActionTask *tsk = new ActionTask(job);
+    if (!o_actionQueue.put(tsk)) {
+        delete tsk;
+        return false;
+    }
+    return true;
+}
+
+static bool queueAction(ActionTask *tsk)
+{
+    bool run = false;
+    {
+        PTMutexLocker lock(o_actionmutex);
+        if (!startActionPool())
+            return false;
+        ActionHost& host = o_actionhosts[tsk->hostport];
+        if (host.inflight < o_actionperdevice) {
+            host.inflight++;
+            run = true;
+        } else {
+            host.waiting.push_back(tsk);
+        }
+    }
+    if (run && !o_actionQueue.put(tsk)) {
+        PTMutexLocker lock(o_actionmutex);
+        // Nothing can be waiting behind tsk if put() fails
+        actionDoneLocked(tsk->hostport);
+        return false;
+    }
+    return true;
+}
+
+void Service::terminateAsync()
+{
+    vector<ActionTask*> dropped;
+    {
+        PTMutexLocker lock(o_actionmutex);
+        if (!o_actionstarted || o_actionterminating)
+            return;
+        o_actionterminating = true;
+        for (auto it = o_actionhosts.begin(); it != o_actionhosts.end();
+             it++) {
+            dropped.insert(dropped.end(), it->second.waiting.begin(),
+                           it->second.waiting.end());
+        }
+        o_actionhosts.clear();
+    }
+
+    // No new tasks can be queued now. The workers flush the queue
+    // without sending, then finish the requests in progress.
+    o_actionQueue.waitIdle();
+    o_actionQueue.setTerminateAndWait();
+
+    for (auto it = dropped.begin(); it != dropped.end(); it++) {
+        if ((*it)->cb)
+            (*it)->cb(UPNP_E_FINISH, *(*it)->data);
+        delete *it;
+    }
+
+    PTMutexLocker lock(o_actionmutex);
+    o_actionstarted = false;
+    o_actionterminating = false;
+}
+
+bool Service::runActionAsync(const SoapOutgoing& args, ActionCB cb)
+{
+    ActionTask *tsk = new ActionTask(m->actionURL, args);
+    tsk->cb = cb;
+    if (!queueAction(tsk)) {
+        delete tsk;
+        return false;
+    }
+    return true;
+}
+
+future<int> Service::runActionAsync(const SoapOutgoing& args,
+                                    SoapIncoming& data)
+{
+    shared_ptr<promise<int> > prom(new promise<int>());
+    future<int> fut = prom->get_future();
+    ActionTask *tsk = new ActionTask(m->actionURL, args);
+    tsk->data = &data;
+    tsk->cb = [prom](int ret, SoapIncoming&) {prom->set_value(ret);};
+    if (!queueAction(tsk)) {
+        delete tsk;
+        prom->set_value(UPNP_E_INTERNAL_ERROR);
+    }
+    return fut;
+}
+
+// Shared between an ActionBatch and its tasks, which may complete
+// after the batch is gone (deadline).
+class BatchEntry {
+public:
+    BatchEntry(const string& url, const SoapOutgoing& _args)
+        : actionURL(url), args(_args), status(UPNP_E_TIMEDOUT), 
+          done(false) {}
+    string actionURL;
+    SoapOutgoing args;
+    SoapIncoming data;
+    int status;
+    bool done;
+};
+
+class BatchState {
+public:
+    BatchState() : pending(0), expired(false) {
+        pthread_cond_init(&cond, 0);
+    }
+    ~BatchState() {
+        pthread_cond_destroy(&cond);
+        for (auto it = entries.begin(); it != entries.end(); it++)
+            delete *it;
+    }
+    PTMutexInit mutex;
+    pthread_cond_t cond;
+    vector<BatchEntry*> entries;
+    int pending;
+    // Set when run() returns: the tasks not started yet are cancelled
+    bool expired;
+};
+
+class ActionBatch::Internal {
+public:
+    Internal() : state(new BatchState()), ran(false) {}
+    shared_ptr<BatchState> state;
+    bool ran;
+    // Snapshot of the entries status when run() returned
+    vector<int> status;
+    vector<bool> done;
+    // Returned by response() for the entries which did not complete
+    SoapIncoming empty;
+};
+
+ActionBatch::ActionBatch()
+{
+    if ((m = new Internal()) == 0) {
+        LOGERR("ActionBatch::ActionBatch: out of memory" << endl);
+        return;
+    }
+}
+
+ActionBatch::~ActionBatch()
+{
+    {
+        PTMutexLocker lock(m->state->mutex);
+        m->state->expired = true;
+    }
+    delete m;
+    m = 0;
+}
+
+int ActionBatch::add(const Service& service, const SoapOutgoing& args)
+{
+    m->state->entries.push_back(new BatchEntry(service.getActionURL(), args));
+    return int(m->state->entries.size()) - 1;
+}
+
+size_t ActionBatch::size() const
+{
+    return m->state->entries.size();
+}
+
+int ActionBatch::run(int timeoutms)
+{
+    if (m->ran) {
+        LOGERR("ActionBatch::run: called twice" << endl);
+        return 0;
+    }
+    m->ran = true;
+    struct timespec deadline;
+    if (timeoutms >= 0) {
+        long long now = usecsnow();
+        deadline.tv_sec = now / 1000000;
+        deadline.tv_nsec = (now % 1000000) * 1000;
+        timespec_addnanos(&deadline, timeoutms * 1000LL * 1000);
+    }
+
+    shared_ptr<BatchState> state = m->state;
+    vector<BatchEntry*>& entries = state->entries;
+    for (unsigned int i = 0; i < entries.size(); i++) {
+        BatchEntry *entry = entries[i];
+        ActionTask *tsk = new ActionTask(entry->actionURL, entry->args);
+        tsk->data = &entry->data;
+        tsk->cb = [state, entry](int ret, SoapIncoming&) {
+            PTMutexLocker lock(state->mutex);
+            entry->status = ret;
+            entry->done = true;
+            state->pending--;
+            pthread_cond_broadcast(&state->cond);
+        };
+        tsk->cancelled = [state]() {
+            PTMutexLocker lock(state->mutex);
+            return state->expired;
+        };
+        {
+            PTMutexLocker lock(state->mutex);
+            state->pending++;
+        }
+        if (!queueAction(tsk)) {
+            delete tsk;
+            PTMutexLocker lock(state->mutex);
+            state->pending--;
+            entry->status = UPNP_E_INTERNAL_ERROR;
+        }
+    }
+
+    PTMutexLocker lock(state->mutex);
+    while (state->pending > 0) {
+        if (timeoutms < 0) {
+            pthread_cond_wait(&state->cond, lock.getMutex());
+        } else if (pthread_cond_timedwait(&state->cond, lock.getMutex(),
+                                          &deadline) == ETIMEDOUT) {
+            LOGINF("ActionBatch::run: " << state->pending << 
+                   " actions timed out" << endl);
+            break;
+        }
+    }
+    state->expired = true;
+    int nok = 0;
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        m->done.push_back((*it)->done);
+        m->status.push_back((*it)->status);
+        if (m->status.back() == UPNP_E_SUCCESS)
+            nok++;
+    }
+    return nok;
+}
+
+int ActionBatch::status(int i) const
+{
+    if (i < 0 || i >= int(m->status.size()))
+        return UPNP_E_INVALID_PARAM;
+    return m->status[i];
+}
+
+SoapIncoming& ActionBatch::response(int i)
+{
+    // An entry which is not done may still be written by its task
+    if (i < 0 || i >= int(m->done.size()) || !m->done[i])
+        return m->empty;
+    return m->state->entries[i]->data;
+}
+
 int Service::runTrivialAction(const std::string& actionName) 
 {
     SoapOutgoing args(m->serviceType, actionName);
@@ -228,7 +721,6 @@ template <class T> int Service::runSimpleAction(const std::string& actnm,
     return runAction(args, data);
 }
 
-static PTMutexInit cblock;
 int Service::srvCB(Upnp_EventType et, void* vevp, void*)
 {
     PTMutexLocker lock(cblock);
@@ -313,26 +805,120 @@ bool Service::initEvents()
 //    LOGDEB("Service::evtCallback!! service: " << m->serviceType << endl);
 //}
 
+// Call with cblock held.
 bool Service::subscribe()
 {
     LOGDEB1("Service::subscribe" << endl);
     LibUPnP* lib = LibUPnP::getLibUPnP();
     if (lib == 0) {
         LOGINF("Service::subscribe: no lib" << endl);
-        return UPNP_E_OUTOF_MEMORY;
+        m->substatus = SUBS_FAILED;
+        return false;
     }
-    int timeout = 1800;
-    int ret = UpnpSubscribe(lib->getclh(), m->eventURL.c_str(),
-                            &timeout, m->SID);
+    SubsRequest *rq = new SubsRequest(this);
+    int ret = UpnpSubscribeAsync(lib->getclh(), m->eventURL.c_str(),
+                                 1800, subsCB, rq);
     if (ret != UPNP_E_SUCCESS) {
         LOGERR("Service:subscribe: failed: " << ret << " : " <<
                UpnpGetErrorMessage(ret) << endl);
+        delete rq;
+        m->substatus = SUBS_FAILED;
         return false;
     } 
-    LOGDEB1("Service::subscribe: sid: " << m->SID << endl);
+    m->subsreq = rq;
+    m->substatus = SUBS_PENDING;
     return true;
 }
 
+// Called by libupnp when the subscription request is done.
+int Service::subsCB(Upnp_EventType, void* vevp, void* cookie)
+{
+    SubsRequest *rq = (SubsRequest *)cookie;
+    struct Upnp_Event_Subscribe *evp = (struct Upnp_Event_Subscribe *)vevp;
+    bool ok = evp->ErrCode == UPNP_E_SUCCESS;
+    bool orphan = false;
+    vector<SubsReadyCB> cbs;
+    {
+        PTMutexLocker lock(cblock);
+        Service *service = rq->service;
+        if (service == 0) {
+            orphan = true;
+        } else {
+            Internal *m = service->m;
+            m->subsreq = 0;
+            if (ok) {
+                strncpy(m->SID, evp->Sid, sizeof(Upnp_SID));
+                m->SID[sizeof(Upnp_SID)-1] = 0;
+                LOGDEB1("Service::subsCB: sid: " << m->SID << endl);
+                o_calls[m->SID] = m->evtcb;
+                m->substatus = SUBS_OK;
+            } else {
+                LOGERR("Service:subscribe: failed: " << evp->ErrCode << 
+                       " : " << UpnpGetErrorMessage(evp->ErrCode) << 
+                       " for " << m->eventURL << endl);
+                m->substatus = SUBS_FAILED;
+            }
+            cbs.swap(m->readycbs);
+            pthread_cond_broadcast(&o_subscond);
+        }
+    }
+    delete rq;
+
+    if (orphan) {
+        // The service object is gone: cancel the subscription.
+        LibUPnP* lib = LibUPnP::getLibUPnP();
+        if (ok && lib) {
+            UpnpUnSubscribe(lib->getclh(), evp->Sid);
+        }
+        return UPNP_E_SUCCESS;
+    }
+    for (auto it = cbs.begin(); it != cbs.end(); it++) {
+        (*it)(ok);
+    }
+    return UPNP_E_SUCCESS;
+}
+
+Service::SubsStatus Service::getSubsStatus() const
+{
+    PTMutexLocker lock(cblock);
+    return m->substatus;
+}
+
+bool Service::waitSubscribed(int timeoutms)
+{
+    struct timespec deadline;
+    if (timeoutms >= 0) {
+        long long now = usecsnow();
+        deadline.tv_sec = now / 1000000;
+        deadline.tv_nsec = (now % 1000000) * 1000;
+        timespec_addnanos(&deadline, timeoutms * 1000LL * 1000);
+    }
+    PTMutexLocker lock(cblock);
+    while (m->substatus == SUBS_PENDING) {
+        if (timeoutms < 0) {
+            pthread_cond_wait(&o_subscond, lock.getMutex());
+        } else if (pthread_cond_timedwait(&o_subscond, lock.getMutex(),
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    return m->substatus == SUBS_OK;
+}
+
+void Service::onSubscribed(SubsReadyCB cb)
+{
+    bool ok;
+    {
+        PTMutexLocker lock(cblock);
+        if (m->substatus == SUBS_PENDING) {
+            m->readycbs.push_back(cb);
+            return;
+        }
+        ok = m->substatus == SUBS_OK;
+    }
+    cb(ok);
+}
+
 bool Service::unSubscribe()
 {
     LOGDEB1("Service::unSubscribe" << endl);
@@ -355,19 +941,126 @@ bool Service::unSubscribe()
 
 void Service::registerCallback(evtCBFunc c)
 {
-    if (!subscribe()) 
-        return;
     PTMutexLocker lock(cblock);
-    LOGDEB1("Service::registerCallback: " << m->SID << endl);
-    o_calls[m->SID] = c;
+    LOGDEB1("Service::registerCallback: " << m->eventURL << endl);
+    m->evtcb = c;
+    subscribe();
 }
 
 void Service::unregisterCallback()
 {
     PTMutexLocker lock(cblock);
     LOGDEB1("Service::unregisterCallback: " << m->SID << endl);
+    if (m->subsreq) {
+        // Still pending: subsCB() will undo the subscription.
+        m->subsreq->service = 0;
+        m->subsreq = 0;
+        m->readycbs.clear();
+        m->substatus = SUBS_NONE;
+        return;
+    }
     o_calls.erase(m->SID);
     unSubscribe();
+    m->substatus = SUBS_NONE;
+}
+
+// The service registry: for each device UDN, the handles created for
+// its services.
+class RegEntry {
+public:
+    RegEntry(shared_ptr<const UPnPDeviceDesc> d, const IString& id,
+             shared_ptr<Service> s) : device(d), serviceId(id), service(s) {}
+    // The description the handle was built from
+    shared_ptr<const UPnPDeviceDesc> device;
+    IString serviceId;
+    shared_ptr<Service> service;
+};
+static unordered_map<string, vector<RegEntry> > o_registry;
+static PTMutexInit o_registry_mutex;
+
+// Directory lost callback: forget the device's services.
+static bool registryDevLost(const UPnPDeviceDesc& device,
+                            const UPnPServiceDesc&)
+{
+    shared_ptr<vector<RegEntry> > entries(new vector<RegEntry>);
+    {
+        PTMutexLocker lock(o_registry_mutex);
+        auto it = o_registry.find(device.UDN);
+        if (it == o_registry.end())
+            return true;
+        LOGDEB1("ServiceRegistry: dropping services for " << device.UDN << 
+                endl);
+        entries->swap(it->second);
+        o_registry.erase(it);
+    }
+    // The handles which are not in use elsewhere are deleted when
+    // the entries go, and unsubscribe, which needs network access and
+    // may be slow if the device is gone. This is done by the action
+    // pool, not by the directory thread which calls us with its
+    // callbacks lock held. If the pool is not available, the entries
+    // are deleted here.
+    queueJob([entries]() {entries->clear();});
+    return true;
+}
+
+// Call with the registry locked
+static vector<RegEntry>::iterator 
+registryFind(vector<RegEntry>& entries, const IString& serviceId)
+{
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        if (it->serviceId == serviceId)
+            return it;
+    }
+    return entries.end();
+}
+
+shared_ptr<Service> 
+ServiceRegistry::getService(shared_ptr<const UPnPDeviceDesc> device, 
+                            const UPnPServiceDesc& service, Factory create)
+{
+    static bool lostcbset(false);
+    bool setlostcb = false;
+    {
+        PTMutexLocker lock(o_registry_mutex);
+        if (!lostcbset) {
+            lostcbset = setlostcb = true;
+        }
+        vector<RegEntry>& entries = o_registry[device->UDN];
+        auto it = registryFind(entries, service.serviceId);
+        if (it != entries.end() && it->device == device)
+            return it->service;
+    }
+    // Not under our lock: the callbacks are called with the directory
+    // callbacks lock held, and this takes it.
+    if (setlostcb)
+        UPnPDeviceDirectory::addLostCallback(registryDevLost);
+
+    // Creating the object may need network access, don't hold the
+    // lock. If another thread did the same meanwhile, its handle wins
+    // and ours is deleted after unlocking.
+    shared_ptr<Service> handle(create(*device, service));
+    shared_ptr<Service> old;
+    PTMutexLocker lock(o_registry_mutex);
+    vector<RegEntry>& entries = o_registry[device->UDN];
+    auto it = registryFind(entries, service.serviceId);
+    if (it != entries.end()) {
+        if (it->device == device) {
+            old = handle;
+            return it->service;
+        }
+        // The description changed (e.g. new URLs after a reboot).
+        old = it->service;
+        entries.erase(it);
+    }
+    entries.push_back(RegEntry(device, service.serviceId, handle));
+    return handle;
+}
+
+void ServiceRegistry::clear()
+{
+    unordered_map<string, vector<RegEntry> > registry;
+    PTMutexLocker lock(o_registry_mutex);
+    registry.swap(o_registry);
 }
 
 template int Service::runSimpleAction<int>(string const&, string const&, int);
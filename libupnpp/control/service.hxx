@@ -20,12 +20,15 @@
 #include <upnp/upnp.h>                  // for UPNP_E_BAD_RESPONSE, etc
 
 #include <functional>                   // for function
+#include <future>                       // for future
 #include <iostream>                     // for basic_ostream, operator<<, etc
+#include <memory>                       // for shared_ptr
 #include <string>                       // for string, operator<<, etc
 #include <unordered_map>                // for unordered_map
 #include <vector>                       // for vector
 
 #include "libupnpp/control/cdircontent.hxx"  // for UPnPDirObject
+#include "libupnpp/istring.hxx"         // for IString
 #include "libupnpp/log.hxx"             // for LOGERR
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, etc
 
@@ -79,6 +82,50 @@ public:
     virtual int runAction(const UPnPP::SoapOutgoing& args, 
                           UPnPP::SoapIncoming& data);
 
+    /** Completion function for runActionAsync(). ret is the
+     * runAction() return value, data the decoded response. */
+    typedef std::function<void (int ret, UPnPP::SoapIncoming& data)> ActionCB;
+
+    /** Run an action without blocking the caller.
+     *
+     * The action is performed by a library thread pool, which is
+     * also where cb is called. The requests to a given device
+     * (host:port) beyond the per-device limit wait in order for the
+     * previous ones to complete, and the total number of requests in
+     * progress is bounded by the pool size (see setAsyncLimits()).
+     *
+     * The arguments and the service URL are copied: the Service
+     * object may be deleted before the action completes.
+     * @return false if the request could not be queued. cb is not
+     *    called in this case.
+     */
+    bool runActionAsync(const UPnPP::SoapOutgoing& args, ActionCB cb);
+
+    /** Run an action without blocking, with the result delivered
+     * through a future. The response is decoded into data, which must
+     * stay valid until the future is ready. */
+    std::future<int> runActionAsync(const UPnPP::SoapOutgoing& args,
+                                    UPnPP::SoapIncoming& data);
+
+    /** Set the limits for the asynchronous actions.
+     * @param perdevice maximum requests in progress for a device.
+     *    Default 2.
+     * @param global maximum requests in progress overall, which is the
+     *    number of pool threads. Default 8. This is only effective
+     *    before the first asynchronous action.
+     */
+    static void setAsyncLimits(int perdevice, int global);
+
+    /** Stop the asynchronous action pool and wait for its threads.
+     *
+     * The requests in progress complete normally. The ones not yet
+     * sent are dropped, with their callback called with
+     * UPNP_E_FINISH. Called by UPnPDeviceDirectory::terminate(): no
+     * callbacks run after it returns. A later runActionAsync()
+     * restarts the pool.
+     */
+    static void terminateAsync();
+
     /** Run trivial action where there are neither input parameters
        nor return data (beyond the status) */
     int runTrivialAction(const std::string& actionName);
@@ -94,10 +141,43 @@ public:
                                            const std::string& valnm,
                                            T value);
 
+    /** Event subscription state. The subscription is requested by
+     * the constructor of the derived class and completes in the
+     * background: the object can be used for actions at once. */
+    enum SubsStatus {SUBS_NONE, SUBS_PENDING, SUBS_OK, SUBS_FAILED};
+    SubsStatus getSubsStatus() const;
+
+    /** Wait for the subscription to complete.
+     * @param timeoutms maximum wait, negative for no limit.
+     * @return true if we are subscribed.
+     */
+    bool waitSubscribed(int timeoutms = -1);
+
+    /** Completion function for onSubscribed(). ok is true if the
+     * subscription succeeded. */
+    typedef std::function<void (bool ok)> SubsReadyCB;
+
+    /** Have cb called when the subscription completes. This happens
+     * immediately, in the calling thread, if it is already done,
+     * else later in a libupnp thread. The function is not called if
+     * the object is deleted first. */
+    void onSubscribed(SubsReadyCB cb);
+
+    /** Return the reporter to call for the events, or null if none
+     * is installed. This forwards to all the installed ones. */
     virtual VarEventReporter *getReporter();
 
+    /** Add a reporter for the events. A handle obtained from the
+     * ServiceRegistry is shared, and each of its users can install
+     * its own: they are all called. A null pointer removes all
+     * the reporters. */
     virtual void installReporter(VarEventReporter* reporter);
 
+    /** Remove a reporter installed by installReporter(). It is not
+     * called any more after this returns, and can be deleted. Must
+     * not be called from inside the reporter. */
+    virtual void removeReporter(VarEventReporter* reporter);
+
     // Can't copy these because this does not make sense for the
     // member function callback.
     Service(Service const&) = delete;
@@ -106,8 +186,8 @@ public:
 protected:
 
     /** Used by a derived class to register its callback method. This
-     * creates an entry in the static map, using m_SID, which was
-     * obtained by subscribe() during construction 
+     * starts the subscription, and the callback is entered in the
+     * static map (indexed by SID) when it completes. Does not block.
      */
     void registerCallback(evtCBFunc c);
     void unregisterCallback();
@@ -121,12 +201,104 @@ private:
     static bool initEvents();
     /* The static event callback given to libupnp */
     static int srvCB(Upnp_EventType et, void* vevp, void*);
+    /* Completion callback for the asynchronous subscription */
+    static int subsCB(Upnp_EventType et, void* vevp, void* cookie);
     /* Tell the UPnP device (through libupnp) that we want to receive
-       its events. This is called by registerCallback() and sets m_SID */
+       its events. This is called by registerCallback() and starts an
+       asynchronous request, which will set the SID */
     virtual bool subscribe();
     virtual bool unSubscribe();
 };
 
+/**
+ * Run the same or different actions on many services concurrently,
+ * for example for multi-room control. The actions go through the
+ * asynchronous action pool (see Service::runActionAsync()), so the
+ * total time is close to the time of the slowest device rather than
+ * the sum, within the pool limits.
+ *
+ * Usage: add() the actions, run(), then look at status() and
+ * response() for each of them.
+ */
+class ActionBatch {
+public:
+    ActionBatch();
+    ~ActionBatch();
+
+    /** Add an action to the batch. The service URL and the arguments
+     * are copied, the Service object needs not outlive the batch.
+     * @return the index of the action, for status() and response().
+     */
+    int add(const Service& service, const UPnPP::SoapOutgoing& args);
+
+    /** Run all the actions and wait for them to complete, or for the
+     * deadline. The actions not started by the deadline are
+     * cancelled. Can only be called once.
+     * @param timeoutms maximum wait, negative for no limit.
+     * @return the number of actions which succeeded.
+     */
+    int run(int timeoutms = -1);
+
+    size_t size() const;
+
+    /** Result for action i: the Service::runAction() return value,
+     * or UPNP_E_TIMEDOUT if it did not complete before the deadline. */
+    int status(int i) const;
+
+    /** Decoded response for action i. Empty if the action failed or
+     * did not complete. */
+    UPnPP::SoapIncoming& response(int i);
+
+    ActionBatch(ActionBatch const&) = delete;
+    ActionBatch& operator=(ActionBatch const&) = delete;
+
+private:
+    class Internal;
+    Internal *m;
+};
+
+/**
+ * Registry of live service handles, indexed by device UDN and service
+ * id. Repeated lookups for a service return the same object, and
+ * reuse its event subscription, instead of building a new one each
+ * time. An entry is dropped when its device leaves the directory, and
+ * rebuilt if the device description changed.
+ *
+ * As the handle is shared, a client should install its event reporter
+ * with installReporter() and remove it with removeReporter() when
+ * done, not reset it with a null pointer.
+ */
+class ServiceRegistry {
+public:
+    /** Return the handle for the service, creating it if needed.
+     * T is the Service class for the service type. A given service 
+     * should always be requested with the same class, else a null
+     * pointer is returned.
+     * @param device the device description, as obtained from the
+     *    directory.
+     * @param service one of device's services.
+     */
+    template <class T> static std::shared_ptr<T>
+    get(std::shared_ptr<const UPnPDeviceDesc> device, 
+        const UPnPServiceDesc& service) {
+        return std::dynamic_pointer_cast<T>(
+            getService(device, service,
+                       [](const UPnPDeviceDesc& d, const UPnPServiceDesc& s) {
+                           return new T(d, s);}));
+    }
+
+    /** Drop all the entries. The handles still in use elsewhere stay
+     * valid. */
+    static void clear();
+
+private:
+    typedef std::function<Service* (const UPnPDeviceDesc&,
+                                    const UPnPServiceDesc&)> Factory;
+    static std::shared_ptr<Service> 
+    getService(std::shared_ptr<const UPnPDeviceDesc> device, 
+               const UPnPServiceDesc& service, Factory create);
+};
+
 } // namespace UPnPClient
 
 #endif /* _SERVICE_H_X_INCLUDED_ */
@@ -0,0 +1,328 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include "libupnpp/control/soaptransport.hxx"
+
+#include <pthread.h>                    // for pthread_cond_wait, etc
+#include <stdio.h>                      // for SEEK_SET
+#include <string.h>                     // for memcpy
+#include <upnp/upnp.h>                  // for UPNP_E_SUCCESS, etc
+
+#include <algorithm>                    // for min
+#include <string>                       // for string
+#include <unordered_map>                // for unordered_map
+#include <vector>                       // for vector
+
+#include <curl/curl.h>
+
+#include "libupnpp/log.hxx"             // for LOGERR, LOGDEB1
+#include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
+#include "libupnpp/soaphelp.hxx"        // for SoapOutgoing, SoapIncoming
+#include "libupnpp/upnpp_p.hxx"         // for baseurl
+
+using namespace std;
+
+namespace UPnPP {
+
+// The connections to a device. Each curl easy handle keeps its
+// connection open after a transfer, so the handles are what we pool.
+// There are at most o_maxperhost handles per host (busy + idle).
+class SoapHost {
+public:
+    SoapHost() : busy(0) {}
+    int busy;
+    vector<CURL*> idle;
+};
+
+static PTMutexInit o_mutex;
+// Signalled when a handle is returned, for the requests waiting for a slot
+static pthread_cond_t o_cond = PTHREAD_COND_INITIALIZER;
+// Indexed by host:port. The entries are never deleted (there are few
+// devices), so that references stay valid while waiting.
+static unordered_map<string, SoapHost> o_hosts;
+static bool o_enabled;
+static bool o_curlinit;
+static int o_maxperhost = 2;
+static long o_timeoutsecs = 10;
+static SoapTransportStats o_stats;
+
+void SoapTransport::setEnabled(bool onoff)
+{
+    PTMutexLocker lock(o_mutex);
+    o_enabled = onoff;
+}
+
+bool SoapTransport::enabled()
+{
+    PTMutexLocker lock(o_mutex);
+    return o_enabled;
+}
+
+void SoapTransport::setMaxPerHost(int n)
+{
+    PTMutexLocker lock(o_mutex);
+    o_maxperhost = n > 0 ? n : 1;
+    pthread_cond_broadcast(&o_cond);
+}
+
+void SoapTransport::setTimeout(int secs)
+{
+    PTMutexLocker lock(o_mutex);
+    o_timeoutsecs = secs > 0 ? secs : 1;
+}
+
+SoapTransportStats SoapTransport::getStats()
+{
+    PTMutexLocker lock(o_mutex);
+    return o_stats;
+}
+
+void SoapTransport::resetStats()
+{
+    PTMutexLocker lock(o_mutex);
+    o_stats = SoapTransportStats();
+}
+
+// Get a handle for the host, waiting if all its connections are in
+// use. If fresh is set, the idle handles are discarded: their
+// connections are probably dead.
+static CURL *getHandle(const string& hostport, bool fresh, bool *reused)
+{
+    PTMutexLocker lock(o_mutex);
+    if (!o_curlinit) {
+        curl_global_init(CURL_GLOBAL_ALL);
+        o_curlinit = true;
+    }
+    SoapHost& host = o_hosts[hostport];
+    if (host.busy >= o_maxperhost) {
+        o_stats.waits++;
+        while (host.busy >= o_maxperhost) {
+            pthread_cond_wait(&o_cond, lock.getMutex());
+        }
+    }
+    if (fresh) {
+        for (auto it = host.idle.begin(); it != host.idle.end(); it++)
+            curl_easy_cleanup(*it);
+        host.idle.clear();
+    }
+    *reused = !host.idle.empty();
+    CURL *curl;
+    if (*reused) {
+        curl = host.idle.back();
+        host.idle.pop_back();
+        curl_easy_reset(curl);
+    } else {
+        curl = curl_easy_init();
+    }
+    if (curl)
+        host.busy++;
+    return curl;
+}
+
+// Give back a handle. It is kept, with its connection, only if the
+// last exchange went well.
+static void putHandle(const string& hostport, CURL *curl, bool keep)
+{
+    PTMutexLocker lock(o_mutex);
+    SoapHost& host = o_hosts[hostport];
+    host.busy--;
+    if (keep && host.busy + int(host.idle.size()) < o_maxperhost) {
+        host.idle.push_back(curl);
+    } else {
+        curl_easy_cleanup(curl);
+    }
+    pthread_cond_broadcast(&o_cond);
+}
+
+static size_t write_callback(void *contents, size_t size, size_t nmemb,
+                             void *userp)
+{
+    size_t realsize = size * nmemb;
+    ((string *)userp)->append((const char *)contents, realsize);
+    return realsize;
+}
+
+// Request body source. libcurl resends a request by itself when a
+// reused connection fails before anything was received, which may be
+// after the device ran the action. It has to rewind the body for
+// this, which we only allow if nothing was read yet.
+class SoapBody {
+public:
+    SoapBody(const string& d) : data(d), offs(0) {}
+    const string& data;
+    size_t offs;
+};
+
+static size_t read_callback(char *buf, size_t size, size_t nitems, 
+                            void *userp)
+{
+    SoapBody *body = (SoapBody *)userp;
+    size_t cnt = min(size * nitems, body->data.size() - body->offs);
+    memcpy(buf, body->data.c_str() + body->offs, cnt);
+    body->offs += cnt;
+    return cnt;
+}
+
+static int seek_callback(void *userp, curl_off_t offset, int origin)
+{
+    SoapBody *body = (SoapBody *)userp;
+    if (origin != SEEK_SET || offset != 0 || body->offs != 0)
+        return CURL_SEEKFUNC_CANTSEEK;
+    return CURL_SEEKFUNC_OK;
+}
+
+// One request/response exchange
+static CURLcode soapPost(CURL *curl, const string& url,
+                         struct curl_slist *headers, const string& body,
+                         string& response, long timeoutsecs,
+                         long *httpcode, long *connects, long *reqsize)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeoutsecs);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    SoapBody src(body);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &src);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_callback);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, &src);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, long(body.size()));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    CURLcode res = curl_easy_perform(curl);
+    *httpcode = *connects = *reqsize = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, httpcode);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, connects);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, reqsize);
+    return res;
+}
+
+// Errors which we get when sending on a connection that the device
+// closed while it was idle, and after which the request can be sent
+// again: the device closed without answering, or the send failed
+// before any data went out. A send or receive error later in the
+// exchange may come after the device ran the action, which may not be
+// idempotent (Next, Seek...), so it is not retried.
+static bool isStaleConnError(CURLcode res, long reqsize)
+{
+    return res == CURLE_GOT_NOTHING || 
+        (res == CURLE_SEND_ERROR && reqsize == 0);
+}
+
+int SoapTransport::runAction(const string& url, const SoapOutgoing& args,
+                             SoapIncoming& data)
+{
+    string body;
+    args.buildSoapEnvelope(body, false);
+    struct curl_slist *headers = 0;
+    headers = curl_slist_append(headers,
+                                "Content-Type: text/xml; charset=\"utf-8\"");
+    headers = curl_slist_append(headers,
+                                (string("SOAPACTION: \"") +
+                                 args.getServiceType() + "#" +
+                                 args.getName() + "\"").c_str());
+    // No "100 Continue" round trip
+    headers = curl_slist_append(headers, "Expect:");
+
+    string hostport = baseurl(url);
+    long timeoutsecs;
+    {
+        PTMutexLocker lock(o_mutex);
+        o_stats.requests++;
+        timeoutsecs = o_timeoutsecs;
+    }
+
+    string response;
+    long httpcode = 0;
+    CURLcode res = CURLE_OK;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        CURL *curl = getHandle(hostport, attempt > 0, &reused);
+        if (curl == 0) {
+            LOGERR("SoapTransport: curl_easy_init failed" << endl);
+            res = CURLE_OUT_OF_MEMORY;
+            break;
+        }
+        response.clear();
+        long connects, reqsize;
+        res = soapPost(curl, url, headers, body, response, timeoutsecs,
+                       &httpcode, &connects, &reqsize);
+        bool retry = res != CURLE_OK && reused && attempt == 0 &&
+            response.empty() && isStaleConnError(res, reqsize);
+        {
+            PTMutexLocker lock(o_mutex);
+            if (retry) {
+                o_stats.retries++;
+            } else if (res == CURLE_OK) {
+                if (connects == 0)
+                    o_stats.reused++;
+                else
+                    o_stats.connects += connects;
+            }
+        }
+        putHandle(hostport, curl, res == CURLE_OK);
+        if (!retry)
+            break;
+        LOGDEB1("SoapTransport: " << curl_easy_strerror(res) <<
+                " on reused connection to " << hostport << ", retrying" <<
+                endl);
+    }
+    curl_slist_free_all(headers);
+
+    if (res != CURLE_OK) {
+        LOGERR("SoapTransport: " << args.getName() << " to " << url <<
+               " : " << curl_easy_strerror(res) << endl);
+        PTMutexLocker lock(o_mutex);
+        o_stats.errors++;
+        switch (res) {
+        case CURLE_OUT_OF_MEMORY: return UPNP_E_OUTOF_MEMORY;
+        case CURLE_OPERATION_TIMEDOUT: return UPNP_E_TIMEDOUT;
+        case CURLE_COULDNT_CONNECT: return UPNP_E_SOCKET_CONNECT;
+        default: return UPNP_E_SOCKET_ERROR;
+        }
+    }
+
+    // A SOAP fault comes with a 500 status, so decode before looking
+    // at the status.
+    if (!data.decodeEnvelope(args.getName().c_str(), response.c_str(),
+                             response.size())) {
+        PTMutexLocker lock(o_mutex);
+        int code;
+        if (data.isFault() && data.get("errorCode", &code)) {
+            o_stats.faults++;
+            LOGDEB1("SoapTransport: " << args.getName() <<
+                    " : UPnP error " << code << endl);
+            return code;
+        }
+        o_stats.errors++;
+        LOGERR("SoapTransport: " << args.getName() << " to " << url <<
+               " : bad response, HTTP status " << httpcode << endl);
+        return UPNP_E_BAD_RESPONSE;
+    }
+    if (httpcode != 200) {
+        LOGERR("SoapTransport: " << args.getName() << " to " << url <<
+               " : HTTP status " << httpcode << endl);
+        PTMutexLocker lock(o_mutex);
+        o_stats.errors++;
+        return UPNP_E_BAD_RESPONSE;
+    }
+    return UPNP_E_SUCCESS;
+}
+
+}
@@ -0,0 +1,95 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _SOAPTRANSPORT_H_X_INCLUDED_
+#define _SOAPTRANSPORT_H_X_INCLUDED_
+
+#include <string>                       // for string
+
+namespace UPnPP {
+
+class SoapOutgoing;
+class SoapIncoming;
+
+/** Counters for the keep-alive SOAP transport */
+class SoapTransportStats {
+public:
+    SoapTransportStats() : requests(0), reused(0), connects(0), retries(0),
+                           waits(0), faults(0), errors(0) {}
+    // Actions sent
+    long long requests;
+    // Exchanges which went over an existing connection
+    long long reused;
+    // New connections opened
+    long long connects;
+    // Requests resent on a new connection after failing on a reused one
+    long long retries;
+    // Requests which had to wait because the device had its maximum
+    // number of connections in use
+    long long waits;
+    // SOAP faults (UPnP errors) returned by the devices
+    long long faults;
+    // Transport or HTTP errors
+    long long errors;
+};
+
+/**
+ * HTTP transport for the SOAP actions, keeping the HTTP/1.1
+ * connections open between requests.
+ *
+ * libupnp opens a new connection for every action. When this
+ * transport is enabled, Service::runAction() uses it instead: each
+ * device (control URL host:port) gets a small set of connections
+ * which are reused by the successive actions. The number of
+ * simultaneous connections to a device is bounded, and the requests
+ * beyond it wait for a free one. If a request fails on a reused
+ * connection (which the device may have closed while idle) before
+ * the device could have received it, or if the device closed the
+ * connection without answering, it is sent again on a new one. Other
+ * failures are returned as errors: the action might have been
+ * performed.
+ */
+class SoapTransport {
+public:
+    /** Use the keep-alive transport for Service::runAction().
+     * Default: off, libupnp's UpnpSendAction() is used. */
+    static void setEnabled(bool onoff);
+    static bool enabled();
+
+    /** Maximum number of connections per device. Default 2. */
+    static void setMaxPerHost(int n);
+
+    /** Timeout for an action exchange. Default 10 S. */
+    static void setTimeout(int secs);
+
+    /** Perform an action.
+     * @param actionURL the service control URL.
+     * @param args the action name, service type and arguments.
+     * @param data the decoded response.
+     * @return UPNP_E_SUCCESS, the UPnP error code (positive) if the
+     *   device returned a SOAP fault, or a negative libupnp error code
+     *   for other errors. This is the same as UpnpSendAction().
+     */
+    static int runAction(const std::string& actionURL,
+                         const SoapOutgoing& args, SoapIncoming& data);
+
+    static SoapTransportStats getStats();
+    static void resetStats();
+};
+
+}
+
+#endif /* _SOAPTRANSPORT_H_X_INCLUDED_ */
@@ -100,6 +100,37 @@ public:
             return false;
         }
 
+    /*
+      Push interface, for feeding the document in pieces as it
+      arrives (e.g. from a download), instead of having Parse() pull
+      it through read_block(). Call ParseFinal() after the last
+      piece. Both return false once an error was encountered.
+    */
+    virtual bool ParseChunk(const char *data, size_t len)
+        {
+            if(!Ready() || getStatus() != XML_STATUS_OK)
+                return false;
+            if(XML_Parse(expat_parser, data, int(len), XML_FALSE) !=
+               XML_STATUS_OK) {
+                status = XML_STATUS_ERROR;
+                last_error = XML_GetErrorCode(expat_parser);
+                return false;
+            }
+            return true;
+        }
+    virtual bool ParseFinal(void)
+        {
+            if(!Ready() || getStatus() != XML_STATUS_OK)
+                return false;
+            if(XML_Parse(expat_parser, getBuffer(), 0, XML_TRUE) !=
+               XML_STATUS_OK) {
+                status = XML_STATUS_ERROR;
+                last_error = XML_GetErrorCode(expat_parser);
+                return false;
+            }
+            return true;
+        }
+
     /* Expose status, error, and control codes to users */
     virtual bool Ready(void) { return valid_parser; };
     virtual XML_Error getLastError(void) { return last_error; };
@@ -0,0 +1,185 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include "istring.hxx"
+
+#include <string>                       // for string
+#include <unordered_map>                // for unordered_map
+
+#include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
+#include "libupnpp/upnpp_p.hxx"         // for typeNoVersion
+
+using namespace std;
+
+namespace UPnPP {
+
+// The table is created on first use, because IString objects may be
+// built during static initialization (e.g. service type constants),
+// and never deleted, as they may also be destroyed during static
+// destruction.
+//
+// An entry is only deleted when its reference count drops to zero,
+// and the last decrement is done with the table locked, so an entry
+// can't be found in the table and deleted at the same time. Reading
+// the value of an IString needs no locking. The empty value is not in
+// the table and is never deleted (its count is not meaningful).
+class ITable {
+public:
+    ITable() {
+        empty.base = &empty;
+        empty.refs = 1;
+    }
+    IString::Entry empty;
+    unordered_map<string, IString::Entry*> entries;
+    PTMutexInit mutex;
+};
+
+static ITable& theTable()
+{
+    static ITable *table = new ITable;
+    return *table;
+}
+
+// Find or create the entry for s, and take a reference on it. Call
+// with the table locked
+static const IString::Entry *intern1(ITable& table, const string& s)
+{
+    if (s.empty())
+        return &table.empty;
+    auto it = table.entries.find(s);
+    if (it != table.entries.end()) {
+        it->second->refs++;
+        return it->second;
+    }
+    IString::Entry *e = new IString::Entry;
+    e->value = s;
+    e->base = e;
+    e->refs = 1;
+    table.entries[s] = e;
+    string base = typeNoVersion(s);
+    if (base.size() != s.size())
+        e->base = intern1(table, base);
+    return e;
+}
+
+static const IString::Entry *intern(const string& s)
+{
+    ITable& table = theTable();
+    if (s.empty())
+        return &table.empty;
+    PTMutexLocker lock(table.mutex);
+    return intern1(table, s);
+}
+
+// Call with the table locked
+static void release1(ITable& table, const IString::Entry *e)
+{
+    while (e != &table.empty && --e->refs == 0) {
+        const IString::Entry *base = e->base;
+        table.entries.erase(e->value);
+        delete e;
+        if (base == e)
+            break;
+        e = base;
+    }
+}
+
+// Drop a reference. Only lock the table if this may be the last one.
+static void release(const IString::Entry *e)
+{
+    int refs = e->refs.load();
+    while (refs > 1) {
+        if (e->refs.compare_exchange_weak(refs, refs - 1))
+            return;
+    }
+    ITable& table = theTable();
+    if (e == &table.empty)
+        return;
+    PTMutexLocker lock(table.mutex);
+    release1(table, e);
+}
+
+IString::IString()
+    : m_e(&theTable().empty)
+{
+}
+
+IString::IString(const Entry *e)
+    : m_e(e)
+{
+    m_e->refs++;
+}
+
+IString::IString(const IString& o)
+    : m_e(o.m_e)
+{
+    m_e->refs++;
+}
+
+IString::~IString()
+{
+    release(m_e);
+}
+
+IString& IString::operator=(const IString& o)
+{
+    if (m_e != o.m_e) {
+        o.m_e->refs++;
+        release(m_e);
+        m_e = o.m_e;
+    }
+    return *this;
+}
+
+IString::IString(const string& s)
+    : m_e(intern(s))
+{
+}
+
+IString::IString(const char *s)
+    : m_e(intern(s ? string(s) : string()))
+{
+}
+
+IString& IString::operator=(const string& s)
+{
+    const Entry *e = intern(s);
+    release(m_e);
+    m_e = e;
+    return *this;
+}
+
+IString& IString::operator=(const char *s)
+{
+    return *this = (s ? string(s) : string());
+}
+
+void IString::clear()
+{
+    release(m_e);
+    m_e = &theTable().empty;
+}
+
+size_t IString::tableSize()
+{
+    ITable& table = theTable();
+    PTMutexLocker lock(table.mutex);
+    return table.entries.size();
+}
+
+} // namespace UPnPP
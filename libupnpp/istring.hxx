@@ -0,0 +1,123 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _ISTRING_H_X_INCLUDED_
+#define _ISTRING_H_X_INCLUDED_
+
+#include <atomic>                       // for atomic
+#include <ostream>                      // for ostream
+#include <string>                       // for string
+
+namespace UPnPP {
+
+/**
+ * Interned string, for the description fields which have few distinct
+ * values across devices: service and device types, service ids,
+ * manufacturer and model names.
+ *
+ * All the IString objects with the same value share a single copy, held
+ * in a process-wide table. The table entries are reference-counted,
+ * and deleted when the last IString using them goes away, so that
+ * values received from the network can't make it grow without
+ * bound. Copying an IString is copying a pointer and incrementing a
+ * counter, and comparing two IStrings is comparing pointers.
+ *
+ * The object converts to a const std::string&, so it can be used
+ * wherever a read-only string is expected. Assigning a string value
+ * interns it.
+ */
+class IString {
+public:
+    IString();
+    explicit IString(const std::string& s);
+    explicit IString(const char *s);
+    IString(const IString& o);
+    ~IString();
+
+    IString& operator=(const IString& o);
+    IString& operator=(const std::string& s);
+    IString& operator=(const char *s);
+
+    const std::string& str() const {return m_e->value;}
+    operator const std::string&() const {return m_e->value;}
+    const char *c_str() const {return m_e->value.c_str();}
+    std::string::size_type size() const {return m_e->value.size();}
+    std::string::size_type length() const {return m_e->value.size();}
+    bool empty() const {return m_e->value.empty();}
+    void clear();
+
+    int compare(const std::string& s) const {
+        return m_e->value.compare(s);
+    }
+    int compare(std::string::size_type pos, std::string::size_type n,
+                const std::string& s) const {
+        return m_e->value.compare(pos, n, s);
+    }
+    int compare(std::string::size_type pos, std::string::size_type n,
+                const std::string& s, std::string::size_type pos2,
+                std::string::size_type n2) const {
+        return m_e->value.compare(pos, n, s, pos2, n2);
+    }
+    std::string::size_type find(const std::string& s,
+                                std::string::size_type pos = 0) const {
+        return m_e->value.find(s, pos);
+    }
+    std::string substr(std::string::size_type pos = 0,
+                       std::string::size_type n = std::string::npos) const {
+        return m_e->value.substr(pos, n);
+    }
+
+    /** The value without the version part, for device and service
+     * types: "urn:schemas-upnp-org:service:ContentDirectory:1" ->
+     * "urn:schemas-upnp-org:service:ContentDirectory". Same as *this if
+     * there is no version. This is computed once per distinct value,
+     * so comparing the base() of two types is also a pointer compare. */
+    IString base() const {return IString(m_e->base);}
+
+    bool operator==(const IString& o) const {return m_e == o.m_e;}
+    bool operator!=(const IString& o) const {return m_e != o.m_e;}
+    bool operator==(const std::string& s) const {return m_e->value == s;}
+    bool operator!=(const std::string& s) const {return m_e->value != s;}
+    bool operator==(const char *s) const {return m_e->value == s;}
+    bool operator!=(const char *s) const {return m_e->value != s;}
+    // Arbitrary but stable order, for use as a map key.
+    bool operator<(const IString& o) const {return m_e < o.m_e;}
+
+    /** Number of distinct values in the table */
+    static size_t tableSize();
+
+    class Entry {
+    public:
+        std::string value;
+        // Holds a reference on the base entry
+        const Entry *base;
+        mutable std::atomic<int> refs;
+    };
+
+private:
+    // Takes a reference on e
+    explicit IString(const Entry *e);
+    const Entry *m_e;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const IString& s)
+{
+    return os << s.str();
+}
+
+} // namespace UPnPP
+
+#endif /* _ISTRING_H_X_INCLUDED_ */
@@ -20,10 +20,14 @@
 
 #include <stdio.h>                      // for sprintf
 #include <stdlib.h>                     // for atoi
+#include <string.h>                     // for strchr, strcmp
 
 #include <iostream>                     // for operator<<, endl, etc
+#include <memory>                       // for shared_ptr
 
+#include "libupnpp/expatmm.hxx"         // for ExpatXMLParser
 #include "libupnpp/log.hxx"             // for LOGDEB, LOGERR, LOGDEB1
+#include "libupnpp/ptmutex.hxx"         // for PTMutexLocker, PTMutexInit
 #include "libupnpp/upnpp_p.hxx"         // for stringToBool
 
 using namespace std;
@@ -32,8 +36,28 @@ namespace UPnPP {
 
 class SoapIncoming::Internal {
 public:
+    Internal() : fault(false) {}
+    // Linear search: the argument lists are short
+    std::string *find(const char *nm) {
+        for (auto it = args.begin(); it != args.end(); it++) {
+            if (!it->first.compare(nm))
+                return &it->second;
+        }
+        return 0;
+    }
+    void set(const std::string& nm, std::string& value) {
+        std::string *vp = find(nm.c_str());
+        if (vp) {
+            vp->swap(value);
+        } else {
+            args.push_back(pair<string, string>(nm, string()));
+            args.back().second.swap(value);
+        }
+    }
     std::string name;
-    std::map<std::string, std::string> args;
+    // Argument names and values, in document order.
+    std::vector<std::pair<std::string, std::string> > args;
+    bool fault;
 };
 
 SoapIncoming::SoapIncoming() 
@@ -110,7 +134,8 @@ bool SoapIncoming::decode(const char *callnm, IXML_Document *actReq)
         // Can we get an empty value here ?
         if (value == 0)
             value = "";
-        m->args[name] = value;
+        string svalue(value);
+        m->set(name, svalue);
     }
     m->name = callnm;
     ret = true;
@@ -128,33 +153,125 @@ const std::string& SoapIncoming::getName() const
 
 bool SoapIncoming::get(const char *nm, bool *value) const
 {
-    map<string, string>::const_iterator it = m->args.find(nm);
-    if (it == m->args.end() || it->second.empty()) {
+    const string *vp = m->find(nm);
+    if (vp == 0 || vp->empty()) {
         return false;
     }
-    return stringToBool(it->second, value);
+    return stringToBool(*vp, value);
 }
 
 bool SoapIncoming::get(const char *nm, int *value) const
 {
-    map<string, string>::const_iterator it = m->args.find(nm);
-    if (it == m->args.end() || it->second.empty()) {
+    const string *vp = m->find(nm);
+    if (vp == 0 || vp->empty()) {
         return false;
     }
-    *value = atoi(it->second.c_str());
+    // Lenient on purpose: some devices send values like "50 " or
+    // "12.0", use the numeric prefix.
+    *value = atoi(vp->c_str());
     return true;
 }
 
 bool SoapIncoming::get(const char *nm, string *value) const
 {
-    map<string, string>::const_iterator it = m->args.find(nm);
-    if (it == m->args.end()) {
+    const string *vp = m->find(nm);
+    if (vp == 0) {
+        return false;
+    }
+    *value = *vp;
+    return true;
+}
+
+bool SoapIncoming::take(const char *nm, string *value)
+{
+    string *vp = m->find(nm);
+    if (vp == 0) {
         return false;
     }
-    *value = it->second;
+    value->clear();
+    value->swap(*vp);
     return true;
 }
 
+bool SoapIncoming::isFault() const
+{
+    return m->fault;
+}
+
+// SAX parser for a SOAP envelope: 
+//   <s:Envelope><s:Body><u:ActionResponse>
+//      <arg1>value</arg1>...
+//   </u:ActionResponse></s:Body></s:Envelope>
+// or, in case of error:
+//   <s:Envelope><s:Body><s:Fault>...<detail>
+//     <UPnPError><errorCode>701</errorCode>...</UPnPError>
+//   </detail></s:Fault></s:Body></s:Envelope>
+// The namespace prefixes vary and are ignored. The argument values are
+// only copied once, from the parser buffers.
+class SoapEnvelopeParser : public ExpatXMLParser {
+public:
+    SoapEnvelopeParser()
+        : ExpatXMLParser(1), fault(false), m_depth(0), m_inbody(false), 
+          m_infault(false) {}
+
+    vector<pair<string, string> > args;
+    bool fault;
+
+protected:
+    static const char *localName(const XML_Char *name) {
+        const char *cp = strchr(name, ':');
+        return cp ? cp + 1 : name;
+    }
+    virtual void StartElement(const XML_Char *name, const XML_Char **) {
+        m_depth++;
+        m_data.clear();
+        const char *lname = localName(name);
+        if (m_depth == 2) {
+            m_inbody = !strcmp(lname, "Body");
+        } else if (m_depth == 3 && m_inbody) {
+            m_infault = !strcmp(lname, "Fault");
+            fault = fault || m_infault;
+        }
+    }
+    virtual void EndElement(const XML_Char *name) {
+        // Arguments are the children of the action element. For a
+        // fault, we want the leaf elements anywhere inside.
+        if (m_inbody && (m_depth == 4 || (m_infault && m_depth > 3))) {
+            args.push_back(pair<string, string>(localName(name), string()));
+            args.back().second.swap(m_data);
+        }
+        m_data.clear();
+        m_depth--;
+    }
+    virtual void CharacterData(const XML_Char *s, int len) {
+        if (m_inbody && m_depth >= 4)
+            m_data.append(s, len);
+    }
+
+private:
+    int m_depth;
+    bool m_inbody;
+    bool m_infault;
+    string m_data;
+};
+
+bool SoapIncoming::decodeEnvelope(const char *callnm, const char *data,
+                                  size_t len)
+{
+    m->name = callnm;
+    m->args.clear();
+    m->fault = false;
+    SoapEnvelopeParser parser;
+    if (!parser.ParseChunk(data, len) || !parser.ParseFinal()) {
+        LOGERR("SoapIncoming::decodeEnvelope: XML parse error: " <<
+               XML_ErrorString(parser.getLastError()) << endl);
+        return false;
+    }
+    m->args.swap(parser.args);
+    m->fault = parser.fault;
+    return !m->fault;
+}
+
 string SoapHelp::xmlQuote(const string& in)
 {
     string out;
@@ -171,6 +288,32 @@ string SoapHelp::xmlQuote(const string& in)
     return out;
 }
 
+// Append in to out, escaping the XML special characters. The runs
+// of ordinary characters are copied in one go.
+static void appendQuoted(string& out, const string& in)
+{
+    const char *cp = in.c_str();
+    const char *start = cp;
+    for (;; cp++) {
+        const char *ent;
+        switch (*cp) {
+        case 0: 
+            // Embedded nul: same as the DOM, stop there.
+            out.append(start, cp - start);
+            return;
+        case '"': ent = "&quot;"; break;
+        case '&': ent = "&amp;"; break;
+        case '<': ent = "&lt;"; break;
+        case '>': ent = "&gt;"; break;
+        case '\'': ent = "&apos;"; break;
+        default: continue;
+        }
+        out.append(start, cp - start);
+        out.append(ent);
+        start = cp + 1;
+    }
+}
+
 string SoapHelp::xmlUnquote(const string& in)
 {
     string out;
@@ -247,11 +390,31 @@ SoapOutgoing::~SoapOutgoing()
     m = 0;
 }
 
+SoapOutgoing::SoapOutgoing(const SoapOutgoing& other)
+{
+    if ((m = new Internal(*other.m)) == 0) {
+        LOGERR("SoapOutgoing::SoapOutgoing: out of memory" << endl);
+        return;
+    }
+}
+
+SoapOutgoing& SoapOutgoing::operator=(const SoapOutgoing& other)
+{
+    if (this != &other)
+        *m = *other.m;
+    return *this;
+}
+
 const string& SoapOutgoing::getName() const 
 {
     return m->name;
 }
 
+const string& SoapOutgoing::getServiceType() const 
+{
+    return m->serviceType;
+}
+
 SoapOutgoing& SoapOutgoing::addarg(const string& k, const string& v) 
 {
     m->data.push_back(pair<string, string>(k, v));
@@ -294,6 +457,75 @@ IXML_Document *SoapOutgoing::buildSoapBody(bool isResponse) const
     return doc;
 }
 
+// Fixed parts of a SOAP envelope for a given action. 
+class SoapTemplate {
+public:
+    // Everything up to the first argument
+    string head;
+    // From the end of the last argument
+    string tail;
+};
+
+// The templates, indexed by service type and action name (with a
+// "Response" suffix for responses). The names come from the network
+// on the device side, so the size is limited: the cache is emptied
+// when it is full. The templates are shared, and stay valid for the
+// users while the cache changes.
+static unordered_map<string, shared_ptr<const SoapTemplate> > o_soaptpls;
+static PTMutexInit o_soaptpls_mutex;
+static const size_t o_soaptpls_max = 256;
+
+static shared_ptr<const SoapTemplate> soapTemplate(const string& serviceType,
+                                                   const string& name,
+                                                   bool isResponse)
+{
+    string topname = isResponse ? name + "Response" : name;
+    string key = serviceType + '#' + topname;
+    {
+        PTMutexLocker lock(o_soaptpls_mutex);
+        auto it = o_soaptpls.find(key);
+        if (it != o_soaptpls.end())
+            return it->second;
+    }
+
+    shared_ptr<SoapTemplate> tpl(new SoapTemplate);
+    tpl->head = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+        "<s:Body><u:" + topname + " xmlns:u=\"" + serviceType + "\">";
+    tpl->tail = "</u:" + topname + "></s:Body>\r\n</s:Envelope>\r\n";
+
+    PTMutexLocker lock(o_soaptpls_mutex);
+    if (o_soaptpls.size() >= o_soaptpls_max)
+        o_soaptpls.clear();
+    o_soaptpls[key] = tpl;
+    return tpl;
+}
+
+void SoapOutgoing::buildSoapEnvelope(string& out, bool isResponse) const
+{
+    shared_ptr<const SoapTemplate> tplp = 
+        soapTemplate(m->serviceType, m->name, isResponse);
+    const SoapTemplate& tpl = *tplp;
+    size_t sz = tpl.head.size() + tpl.tail.size();
+    for (auto it = m->data.begin(); it != m->data.end(); it++) {
+        sz += 2 * it->first.size() + it->second.size() + 5;
+    }
+    out.clear();
+    out.reserve(sz);
+    out.append(tpl.head);
+    for (auto it = m->data.begin(); it != m->data.end(); it++) {
+        out += '<';
+        out.append(it->first);
+        out += '>';
+        appendQuoted(out, it->second);
+        out.append("</");
+        out.append(it->first);
+        out += '>';
+    }
+    out.append(tpl.tail);
+}
+
 // Decoding UPnP Event data. The variable values are contained in a
 // propertyset XML document:
 //     <?xml version="1.0"?>
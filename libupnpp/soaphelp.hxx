@@ -43,6 +43,22 @@ public:
      */
     bool decode(const char *name, IXML_Document *actReq);
 
+    /** Decode the text of a SOAP envelope, as received from the
+     * network, without building a DOM.
+     *
+     * @param name the action name.
+     * @param data the envelope text.
+     * @param len the text length.
+     * @return false if the document could not be parsed, or if it is a
+     *    SOAP Fault. In the latter case, isFault() returns true, and the
+     *    UPnP error details are available as the "errorCode" and 
+     *    "errorDescription" values.
+     */
+    bool decodeEnvelope(const char *name, const char *data, size_t len);
+
+    /** Check if the envelope was a SOAP Fault */
+    bool isFault() const;
+
     /** Get action name */
     const std::string& getName() const;
 
@@ -52,6 +68,9 @@ public:
     bool get(const char *nm, int *value) const;
     /** Get string parameter value */
     bool get(const char *nm, std::string *value) const;
+    /** Move string parameter value out, leaving it empty. This avoids
+     * copying big values like Browse results */
+    bool take(const char *nm, std::string *value);
 
 private:
     class Internal;
@@ -79,6 +98,8 @@ public:
     SoapOutgoing();
     SoapOutgoing(const std::string& st, const std::string& nm);
     ~SoapOutgoing();
+    SoapOutgoing(const SoapOutgoing& other);
+    SoapOutgoing& operator=(const SoapOutgoing& other);
 
     SoapOutgoing& addarg(const std::string& k, const std::string& v);
 
@@ -88,7 +109,16 @@ public:
        vector of named values */
     IXML_Document *buildSoapBody(bool isResp = true) const;
 
+    /** Build the complete SOAP envelope text, without going through
+     * a DOM. The fixed parts for each (service type, action) pair are
+     * computed once and cached, the values are escaped while copying.
+     * @param out the output buffer. It is cleared first: reusing the same
+     *    string for successive calls avoids reallocating.
+     */
+    void buildSoapEnvelope(std::string& out, bool isResp = true) const;
+
     const std::string& getName() const;
+    const std::string& getServiceType() const;
 
 private:
     class Internal;
@@ -30,6 +30,10 @@ namespace UPnPP {
 extern std::string caturl(const std::string& s1, const std::string& s2);
 // Return the scheme://host:port[/] part of input, or input if it is weird
 extern std::string baseurl(const std::string& url);
+// Strip the version from a device or service type. e.g.
+// urn:schemas-upnp-org:service:ContentDirectory:1 ->
+// urn:schemas-upnp-org:service:ContentDirectory
+extern std::string typeNoVersion(const std::string& tp);
 extern void trimstring(std::string &s, const char *ws = " \t\n");
 extern std::string path_getfather(const std::string &s);
 extern std::string path_getsimple(const std::string &s);
@@ -22,6 +22,7 @@
 #include <stdio.h>                      // for sprintf
 #include <string.h>                     // for strncpy
 #include <time.h>                       // for timespec
+#include <sys/time.h>                   // for gettimeofday
 
 #include <upnp/ixml.h>                  // for ixmlRelaxParser
 #include <upnp/upnptools.h>             // for UpnpGetErrorMessage
@@ -41,6 +42,7 @@
 
 #include "log.hxx"                      // for LOGERR, LOGDEB1, LOGDEB, etc
 #include "md5.hxx"                      // for MD5String
+#include "libupnpp/control/service.hxx"  // for Service::terminateAsync
 
 using namespace std;
 
@@ -244,6 +246,11 @@ std::string LibUPnP::errAsString(const std::string& who, int code)
     return os.str();
 }
 
+void LibUPnP::dispatchEvent(Upnp_EventType et, void *evp)
+{
+    o_callback(et, evp, this);
+}
+
 int LibUPnP::o_callback(Upnp_EventType et, void* evp, void* cookie)
 {
     LibUPnP *ulib = (LibUPnP *)cookie;
@@ -263,6 +270,8 @@ int LibUPnP::o_callback(Upnp_EventType et, void* evp, void* cookie)
 
 LibUPnP::~LibUPnP()
 {
+    // No action callbacks after the library is gone
+    UPnPClient::Service::terminateAsync();
     int error = UpnpFinish();
     if (error != UPNP_E_SUCCESS) {
         LOGINF("LibUPnP::~LibUPnP: " << errAsString("UpnpFinish", error)
@@ -362,6 +371,16 @@ string baseurl(const string& url)
     }
 }
 
+// Only a last element made of digits is a version.
+string typeNoVersion(const string& tp)
+{
+    string::size_type pos = tp.find_last_of(':');
+    if (pos == string::npos || pos == tp.size() - 1 ||
+        tp.find_first_not_of("0123456789", pos + 1) != string::npos)
+        return tp;
+    return tp.substr(0, pos);
+}
+
 static void path_catslash(string &s) {
     if (s.empty() || s[s.length() - 1] != '/')
         s += '/';
@@ -517,4 +536,11 @@ void timespec_addnanos(struct timespec *ts, long long nanos)
     ts->tv_nsec = nanos;
 }
 
+long long usecsnow()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 }
@@ -90,6 +90,12 @@ public:
      */
     void registerHandler(Upnp_EventType et, Upnp_FunPtr handler, void *cookie);
 
+    /** Deliver an event to the registered handler, as if it had been
+     * reported by libupnp. This is for tests and benchmarks which
+     * simulate network activity (e.g. injecting discovery messages).
+     */
+    void dispatchEvent(Upnp_EventType et, void *evp);
+
     /** Translate libupnp event type as string */
     static std::string evTypeAsString(Upnp_EventType);
 
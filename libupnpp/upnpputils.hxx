@@ -21,6 +21,9 @@ namespace UPnPP {
 
 extern void timespec_addnanos(struct timespec *ts, long long nanos);
 
+// Current time in microseconds since the epoch, for measuring delays.
+extern long long usecsnow();
+
 }
 
 #endif /* _UPNPPUTILS_H_X_INCLUDED_ */
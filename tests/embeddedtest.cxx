@@ -0,0 +1,273 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// Discovery of a device through messages about its embedded device
+// and services only, as happens with the answers to a targeted search
+// (searchFor()). The directory must hold a single entry for the
+// device, under the root device UDN, and a byebye for the root must
+// remove it. The directory is restricted to the embedded device
+// type (setInterest()), which must not discard the device, and it
+// must be found by type and by a searchFor() on that type.
+//
+// The messages are injected into the discovery callback, and the
+// description is served from a loopback HTTP server. Run by
+// "make check".
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <upnp/upnp.h>
+
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/control/description.hxx"
+#include "libupnpp/control/discovery.hxx"
+
+using namespace std;
+using namespace UPnPP;
+using namespace UPnPClient;
+
+static const char *rootUDN = "uuid:embtest-root";
+static const char *embUDN = "uuid:embtest-embedded";
+static const char *rootDevType = "urn:libupnpp-test:device:Root:1";
+static const char *embDevType = "urn:libupnpp-test:device:Embedded:1";
+static const char *embSvcType = "urn:libupnpp-test:service:EmbSvc:1";
+
+static const char *descDoc =
+    "<?xml version=\"1.0\"?>\n"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+    "<specVersion><major>1</major><minor>0</minor></specVersion>\n"
+    "<device>\n"
+    "<deviceType>urn:libupnpp-test:device:Root:1</deviceType>\n"
+    "<friendlyName>Embedded test</friendlyName>\n"
+    "<manufacturer>libupnpp</manufacturer>\n"
+    "<modelName>embeddedtest</modelName>\n"
+    "<UDN>uuid:embtest-root</UDN>\n"
+    "<deviceList>\n"
+    "<device>\n"
+    "<deviceType>urn:libupnpp-test:device:Embedded:1</deviceType>\n"
+    "<UDN>uuid:embtest-embedded</UDN>\n"
+    "<serviceList>\n"
+    "<service><serviceType>urn:libupnpp-test:service:EmbSvc:1</serviceType>"
+    "<serviceId>urn:libupnpp-test:serviceId:EmbSvc</serviceId>"
+    "<SCPDURL>/scpd.xml</SCPDURL><controlURL>/ctl</controlURL>"
+    "<eventSubURL>/evt</eventSubURL></service>\n"
+    "</serviceList>\n"
+    "</device>\n"
+    "</deviceList>\n"
+    "</device>\n"
+    "</root>\n";
+
+static int o_listenfd = -1;
+static int o_port;
+
+static void *serverWorker(void *)
+{
+    for (;;) {
+        int fd = accept(o_listenfd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return 0;
+        }
+        string req;
+        char buf[2048];
+        while (req.find("\r\n\r\n") == string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            req.append(buf, n);
+        }
+        ostringstream resp;
+        resp << "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\n" <<
+            "Content-Length: " << strlen(descDoc) << "\r\n" <<
+            "Connection: close\r\n\r\n" << descDoc;
+        string data = resp.str();
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = send(fd, data.c_str() + done, data.size() - done, 0);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        close(fd);
+    }
+}
+
+static bool startServer()
+{
+    o_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (o_listenfd < 0)
+        return false;
+    int one = 1;
+    setsockopt(o_listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(o_listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(o_listenfd, 16) < 0 ||
+        getsockname(o_listenfd, (struct sockaddr *)&addr, &len) < 0)
+        return false;
+    o_port = ntohs(addr.sin_port);
+    pthread_t thr;
+    if (pthread_create(&thr, 0, serverWorker, 0))
+        return false;
+    pthread_detach(thr);
+    return true;
+}
+
+static void inject(Upnp_EventType et, const char *udn, const char *devtype,
+                   const char *stype)
+{
+    struct Upnp_Discovery disco;
+    memset(&disco, 0, sizeof(disco));
+    disco.Expires = 1800;
+    snprintf(disco.DeviceId, sizeof(disco.DeviceId), "%s", udn);
+    snprintf(disco.Location, sizeof(disco.Location),
+             "http://127.0.0.1:%d/desc.xml", o_port);
+    snprintf(disco.DeviceType, sizeof(disco.DeviceType), "%s", devtype);
+    snprintf(disco.ServiceType, sizeof(disco.ServiceType), "%s", stype);
+    LibUPnP::getLibUPnP()->dispatchEvent(et, &disco);
+}
+
+// Count the distinct directory entries for our device. Real devices
+// on the LAN, if any, are ignored.
+static int countEntries(UPnPDeviceDirectory *dir, set<string>& udns)
+{
+    set<const UPnPDeviceDesc*> entries;
+    udns.clear();
+    dir->traverse([&](const UPnPDeviceDesc& dev, const UPnPServiceDesc&) {
+            if (dev.friendlyName.find("Embedded test") != string::npos) {
+                entries.insert(&dev);
+                udns.insert(dev.UDN);
+            }
+            return true;
+        });
+    return int(entries.size());
+}
+
+// searchFor() on the embedded type, run while the messages come in
+static bool o_searchok;
+static void *searchWorker(void *arg)
+{
+    UPnPDeviceDirectory *dir = (UPnPDeviceDirectory *)arg;
+    bool found = false;
+    o_searchok = dir->searchFor(
+        embDevType,
+        [&](const UPnPDeviceDesc& dev) {
+            if (dev.UDN == rootUDN)
+                found = true;
+        },
+        [&]() {return found;}, 5);
+    return 0;
+}
+
+static int failures;
+
+static void check(bool ok, const string& what)
+{
+    cout << (ok ? "PASS: " : "FAIL: ") << what << endl;
+    if (!ok)
+        failures++;
+}
+
+int main(int, char **)
+{
+    Logger::getTheLog("")->setLogLevel(Logger::LLERR);
+    if (!startServer()) {
+        cerr << "Can't start the description server" << endl;
+        return 1;
+    }
+    if (LibUPnP::getLibUPnP() == 0) {
+        cerr << "Can't initialize libupnp" << endl;
+        return 1;
+    }
+    UPnPDeviceDirectory::setInterest(vector<string>(1, embDevType));
+    UPnPDeviceDirectory *dir = UPnPDeviceDirectory::getTheDir(1);
+    if (dir == 0) {
+        cerr << "Can't create the device directory" << endl;
+        return 1;
+    }
+    pthread_t searchthr;
+    if (pthread_create(&searchthr, 0, searchWorker, dir)) {
+        cerr << "Can't start the search thread" << endl;
+        return 1;
+    }
+    usleep(200 * 1000);
+
+    // Typed search answers for the embedded device and its service,
+    // without any root device message.
+    inject(UPNP_DISCOVERY_SEARCH_RESULT, embUDN, embDevType, "");
+    inject(UPNP_DISCOVERY_SEARCH_RESULT, embUDN, "", embSvcType);
+
+    set<string> udns;
+    int count = 0;
+    for (int i = 0; i < 50 && count == 0; i++) {
+        usleep(100 * 1000);
+        count = countEntries(dir, udns);
+    }
+    check(count == 1, "one directory entry for the device");
+    check(udns.size() == 1 && udns.count(rootUDN),
+          "entry is known by the root UDN");
+
+    DDescH dev;
+    check(dir->getDevByUDN(rootUDN, dev) && dev && dev->UDN == rootUDN,
+          "getDevByUDN() finds the root UDN");
+    vector<DDescH> devs;
+    dir->getDevsByServiceType(embSvcType, devs);
+    check(devs.size() == 1, "service type index holds one entry");
+    devs.clear();
+    dir->getDevsByType(embDevType, devs);
+    check(devs.size() == 1 && devs[0]->UDN == rootUDN,
+          "found by the embedded device type");
+    devs.clear();
+    dir->getDevsByType(rootDevType, devs);
+    check(devs.size() == 1 && devs[0]->deviceType == rootDevType,
+          "found by the root device type");
+    pthread_join(searchthr, 0);
+    check(o_searchok, "searchFor() the embedded type finds the device");
+
+    // Messages repeated after the description was parsed must not
+    // create another entry.
+    inject(UPNP_DISCOVERY_SEARCH_RESULT, embUDN, embDevType, "");
+    usleep(500 * 1000);
+    check(countEntries(dir, udns) == 1, "still one entry after repeats");
+
+    // The byebye for the root device removes the entry.
+    inject(UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE, rootUDN, "", "");
+    for (int i = 0; i < 50 && count != 0; i++) {
+        usleep(100 * 1000);
+        count = countEntries(dir, udns);
+    }
+    check(count == 0, "root byebye removes the entry");
+
+    UPnPDeviceDirectory::terminate();
+    return failures ? 1 : 0;
+}